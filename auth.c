@@ -0,0 +1,208 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#ifdef __OpenBSD__
+#include <bsd_auth.h>
+#else
+#include <security/pam_appl.h>
+#endif
+
+#include "i3lock.h"
+#include "auth.h"
+#include "trace.h"
+
+extern bool debug_mode;
+
+#ifdef __OpenBSD__
+static char *bsdauth_username;
+
+static bool bsdauth_init(const char *username) {
+    if ((bsdauth_username = strdup(username)) == NULL) {
+        perror("strdup");
+        return false;
+    }
+    return true;
+}
+
+static bool bsdauth_check(const char *password) {
+    /* auth_userokay() does not modify the password, despite its signature. */
+    return (auth_userokay(bsdauth_username, NULL, NULL, (char *)password) != 0);
+}
+
+static void bsdauth_finish(void) {
+}
+
+static const auth_backend_t bsdauth_backend = {"bsdauth", bsdauth_init, bsdauth_check, bsdauth_finish};
+#define DEFAULT_BACKEND bsdauth_backend
+#else
+static pam_handle_t *pam_handle;
+
+/*
+ * Callback function for PAM. We only react on password request callbacks. The
+ * password to answer with is passed as appdata_ptr.
+ *
+ */
+static int conv_callback(int num_msg, const struct pam_message **msg,
+                         struct pam_response **resp, void *appdata_ptr) {
+    const char *password = appdata_ptr;
+
+    if (num_msg == 0)
+        return 1;
+
+    /* PAM expects an array of responses, one for each message */
+    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (int c = 0; c < num_msg; c++) {
+        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
+            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
+            continue;
+
+        /* return code is currently not used but should be set to zero */
+        (*resp)[c].resp_retcode = 0;
+        if (((*resp)[c].resp = strdup(password)) == NULL) {
+            perror("strdup");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static bool pam_init(const char *username) {
+    /* The conversation is set for each check, along with the password. */
+    static const struct pam_conv conv = {conv_callback, ""};
+    int ret;
+    int trace = trace_begin("pam_start");
+
+    /* This already loads the modules of the stack. Their own setup is left
+     * to the first pam_authenticate(): any call into the stack before a
+     * password is entered has side effects, e.g. pam_faillock counting a
+     * failed attempt or resetting its counter. */
+    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS) {
+        fprintf(stderr, "[i3lock] PAM: %s\n", pam_strerror(pam_handle, ret));
+        trace_end(trace);
+        return false;
+    }
+
+    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS) {
+        fprintf(stderr, "[i3lock] PAM: %s\n", pam_strerror(pam_handle, ret));
+        pam_end(pam_handle, ret);
+        trace_end(trace);
+        return false;
+    }
+
+    trace_end(trace);
+    return true;
+}
+
+static bool pam_check(const char *password) {
+    const struct pam_conv conv = {conv_callback, (void *)password};
+    int ret;
+
+    if ((ret = pam_set_item(pam_handle, PAM_CONV, &conv)) != PAM_SUCCESS) {
+        fprintf(stderr, "[i3lock] PAM: %s\n", pam_strerror(pam_handle, ret));
+        return false;
+    }
+
+    return (pam_authenticate(pam_handle, 0) == PAM_SUCCESS);
+}
+
+static void pam_finish(void) {
+    /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
+     * Related to credentials pam_end() needs to be called to cleanup any temporary
+     * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
+     * refresh of the credentials failed. */
+    pam_setcred(pam_handle, PAM_REFRESH_CRED);
+    pam_end(pam_handle, PAM_SUCCESS);
+}
+
+static const auth_backend_t pam_backend = {"pam", pam_init, pam_check, pam_finish};
+#define DEFAULT_BACKEND pam_backend
+#endif
+
+#ifdef ENABLE_MOCK_AUTH
+/*
+ * The mock backend (--auth-backend=mock:<delay_ms>:<accept|reject>) waits for
+ * the given time and then accepts or rejects any password, so that the
+ * authentication path can be measured without a real PAM stack.
+ *
+ */
+static long mock_delay_ms;
+static bool mock_accept;
+
+static bool mock_init(const char *username) {
+    DEBUG("mock authentication backend: %ld ms, %s\n", mock_delay_ms, (mock_accept ? "accept" : "reject"));
+    return true;
+}
+
+static bool mock_check(const char *password) {
+    struct timespec delay = {mock_delay_ms / 1000, (mock_delay_ms % 1000) * 1000000};
+
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+
+    return mock_accept;
+}
+
+static void mock_finish(void) {
+}
+
+static const auth_backend_t mock_backend = {"mock", mock_init, mock_check, mock_finish};
+
+static bool parse_mock_spec(const char *params) {
+    char *endptr;
+
+    mock_delay_ms = strtol(params, &endptr, 10);
+    if (endptr == params || *endptr != ':' || mock_delay_ms < 0)
+        return false;
+
+    if (strcmp(endptr + 1, "accept") == 0)
+        mock_accept = true;
+    else if (strcmp(endptr + 1, "reject") == 0)
+        mock_accept = false;
+    else
+        return false;
+
+    return true;
+}
+#endif
+
+static const auth_backend_t *backend = &DEFAULT_BACKEND;
+
+bool auth_set_backend(const char *spec) {
+    if (strcmp(spec, DEFAULT_BACKEND.name) == 0) {
+        backend = &DEFAULT_BACKEND;
+        return true;
+    }
+
+#ifdef ENABLE_MOCK_AUTH
+    if (strncmp(spec, "mock:", strlen("mock:")) == 0 &&
+        parse_mock_spec(spec + strlen("mock:"))) {
+        backend = &mock_backend;
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+const auth_backend_t *auth_backend(void) {
+    return backend;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * An authentication backend. i3lock uses PAM, or bsd_auth(3) on OpenBSD. For
+ * benchmarking, a mock backend can be compiled in (--enable-mock-auth).
+ *
+ */
+typedef struct auth_backend {
+    const char *name;
+
+    /* Prepares authenticating the given user. Called once at startup, on a
+     * worker thread, so it must not exit: on error, it prints a message and
+     * returns false. */
+    bool (*init)(const char *username);
+
+    /* Checks the given password. Called in the authentication helper process
+     * (see input_done()). */
+    bool (*check)(const char *password);
+
+    /* Called in the authentication helper process after check() succeeded,
+     * e.g. to refresh credentials. */
+    void (*finish)(void);
+} auth_backend_t;
+
+/**
+ * Selects the backend given by --auth-backend. Returns false if there is no
+ * such backend (or its parameters are invalid).
+ *
+ */
+bool auth_set_backend(const char *spec);
+
+/**
+ * Returns the selected backend (the platform's default unless
+ * auth_set_backend() was called).
+ *
+ */
+const auth_backend_t *auth_backend(void);
@@ -0,0 +1,170 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * count-alloc.c: counts the heap allocations (malloc() and friends, no matter
+ *                whether they are freed again) of the process it is preloaded
+ *                into with LD_PRELOAD, but only those of a thread which
+ *                enabled counting with i3lock_count_allocations(). i3lock
+ *                does that while handling a key press and rendering the
+ *                resulting frame, see check_key_allocations().
+ *
+ *                i3lock --debug reports key presses which allocated. If
+ *                COUNT_ALLOC_FILE is set, the count is also kept in that file
+ *                (mapped into memory), so that i3lock-bench keys can read it
+ *                from the outside.
+ *
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+
+static unsigned long allocations = 0;
+/* Initial-exec, so that accessing it never needs to allocate. */
+static __thread bool counting __attribute__((tls_model("initial-exec"))) = false;
+static unsigned long *shared = NULL;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+/* dlsym() might allocate while we look up the real functions. Those
+ * allocations are served from here (and never freed). */
+static char bootstrap[4096] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+static bool resolving = false;
+
+static void resolve(void) {
+    if (real_free != NULL)
+        return;
+
+    resolving = true;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_free = dlsym(RTLD_NEXT, "free");
+    resolving = false;
+}
+
+static void *bootstrap_alloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + size > sizeof(bootstrap))
+        abort();
+    void *ptr = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return ptr;
+}
+
+static bool is_bootstrap(void *ptr) {
+    return ((char *)ptr >= bootstrap && (char *)ptr < bootstrap + sizeof(bootstrap));
+}
+
+static void count(void) {
+    if (!counting)
+        return;
+    unsigned long n = __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    if (shared != NULL)
+        __atomic_store_n(shared, n, __ATOMIC_RELAXED);
+}
+
+void i3lock_count_allocations(bool enable) {
+    counting = enable;
+}
+
+unsigned long i3lock_allocation_count(void) {
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+/* fork()ed children (e.g. the authentication helper) count on their own. */
+static void forget_shared(void) {
+    shared = NULL;
+}
+
+__attribute__((constructor)) static void init(void) {
+    const char *path = getenv("COUNT_ALLOC_FILE");
+    if (path == NULL)
+        return;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(unsigned long)) == -1)
+        abort();
+    void *map = mmap(NULL, sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        abort();
+    close(fd);
+
+    /* Processes started by this one must not write to the file. */
+    unsetenv("COUNT_ALLOC_FILE");
+    pthread_atfork(NULL, NULL, forget_shared);
+    shared = map;
+    __atomic_store_n(shared, i3lock_allocation_count(), __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    if (resolving)
+        return bootstrap_alloc(size);
+    resolve();
+    count();
+    return real_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (resolving)
+        return bootstrap_alloc(nmemb * size);
+    resolve();
+    count();
+    return real_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    resolve();
+    count();
+    if (is_bootstrap(ptr)) {
+        /* The old size is unknown, but it cannot extend past bootstrap. */
+        size_t available = bootstrap + sizeof(bootstrap) - (char *)ptr;
+        void *copy = real_malloc(size);
+        if (copy != NULL)
+            memcpy(copy, ptr, (size < available ? size : available));
+        return copy;
+    }
+    return real_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || is_bootstrap(ptr))
+        return;
+    resolve();
+    real_free(ptr);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    resolve();
+    count();
+    return real_posix_memalign(memptr, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    resolve();
+    count();
+    return real_aligned_alloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    resolve();
+    count();
+    return real_memalign(alignment, size);
+}
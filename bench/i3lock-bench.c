@@ -0,0 +1,744 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * i3lock-bench.c: helper for the benchmark drivers in bench/. It generates
+ *                 test images, and starts i3lock on a (Xvfb) display,
+ *                 injecting key presses with XTest and watching the screen
+ *                 for their effect.
+ *
+ */
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#include <xkbcommon/xkbcommon.h>
+#include <cairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* How long to wait for i3lock to lock and unlock, see cmd_run(). */
+#define RUN_TIMEOUT_S 30
+/* The interval in which Return is pressed until i3lock exits. */
+#define UNLOCK_INTERVAL_MS 20
+/* How long a key press may take to change the indicator before it is counted
+ * as missed, see wait_for_change(). */
+#define KEY_TIMEOUT_MS 500
+/* The pause between measured key presses, so that they do not queue up. */
+#define KEY_INTERVAL_MS 30
+/* Key presses at the start of cmd_keys() which are not measured, since they
+ * load what i3lock loads lazily (e.g. the compose table). */
+#define WARMUP_KEYS 5
+/* After this many key presses which add to the password, the input is
+ * cleared, so that it does not hit the maximum length. */
+#define CLEAR_INTERVAL 100
+/* How long i3lock may take to catch up after cmd_stress() injected its keys
+ * before we give up waiting. */
+#define DRAIN_TIMEOUT_MS 5000
+/* How long cmd_cover() lets i3lock handle the events caused by reconfiguring
+ * the screen, and how long it then waits for the screen to be covered. */
+#define SETTLE_MS 500
+#define COVER_TIMEOUT_MS 2000
+
+static xcb_connection_t *conn;
+static xcb_screen_t *screen;
+
+/* The core keyboard mapping, see load_keyboard_mapping(). */
+static xcb_keycode_t min_keycode;
+static int keysyms_per_keycode;
+static int num_keycodes;
+static xcb_keysym_t *keysyms;
+
+/* The area of the screen which shows the unlock indicator, see snapshot(). */
+static xcb_rectangle_t watch;
+
+/* What cmd_keys() measures: the time from injecting key (while holding
+ * modifier) until the indicator changes. Before that, prefix is typed, and if
+ * it changes the indicator, that change is waited for. */
+typedef struct key_case {
+    const char *name;
+    xkb_keysym_t prefix;
+    bool prefix_changes;
+    xkb_keysym_t modifier;
+    xkb_keysym_t key;
+    /* Whether the key adds to the password, see CLEAR_INTERVAL. */
+    bool adds;
+} key_case_t;
+
+static const key_case_t key_cases[] = {
+    {"normal", XKB_KEY_NoSymbol, false, XKB_KEY_NoSymbol, XKB_KEY_a, true},
+    {"backspace", XKB_KEY_a, true, XKB_KEY_NoSymbol, XKB_KEY_BackSpace, false},
+    {"escape", XKB_KEY_a, true, XKB_KEY_NoSymbol, XKB_KEY_Escape, false},
+    {"ctrl_u", XKB_KEY_a, true, XKB_KEY_Control_L, XKB_KEY_u, false},
+    /* Needs a keymap with dead keys, e.g. setxkbmap -layout us -variant intl */
+    {"compose", XKB_KEY_dead_acute, false, XKB_KEY_NoSymbol, XKB_KEY_e, true},
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec delay = {ms / 1000, (ms % 1000) * 1000000};
+
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+}
+
+static void usage(void) {
+    errx(EXIT_FAILURE,
+         "Syntax: i3lock-bench image <width>x<height> <png|native|rgb|xrgb|rgbx|bgr|xbgr|bgrx> <file>\n"
+         "        i3lock-bench run <stamp file> <i3lock> [arguments...]\n"
+         "        i3lock-bench keys <normal|backspace|escape|ctrl_u|compose> <count> <x>,<y>,<width>x<height> <i3lock> [arguments...]\n"
+         "        i3lock-bench stress <keys per second> <even count> <x>,<y>,<width>x<height> <i3lock> [arguments...]\n"
+         "        i3lock-bench cover <command> <i3lock> [arguments...]");
+}
+
+/*
+ * Connects to the display given by DISPLAY and makes sure it supports XTest.
+ *
+ */
+static void connect_x11(void) {
+    int screennr;
+
+    conn = xcb_connect(NULL, &screennr);
+    if (xcb_connection_has_error(conn))
+        errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
+
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(conn));
+    for (int c = 0; c < screennr; c++)
+        xcb_screen_next(&iter);
+    screen = iter.data;
+
+    const xcb_query_extension_reply_t *xtest = xcb_get_extension_data(conn, &xcb_test_id);
+    if (xtest == NULL || !xtest->present)
+        errx(EXIT_FAILURE, "The X server does not support XTest");
+}
+
+/*
+ * Fetches the core keyboard mapping, which tells us the keycodes to inject
+ * for a given key symbol. Called again after the keymap was changed.
+ *
+ */
+static void load_keyboard_mapping(void) {
+    const xcb_setup_t *setup = xcb_get_setup(conn);
+
+    min_keycode = setup->min_keycode;
+    num_keycodes = setup->max_keycode - setup->min_keycode + 1;
+
+    xcb_get_keyboard_mapping_reply_t *reply = xcb_get_keyboard_mapping_reply(
+        conn, xcb_get_keyboard_mapping(conn, min_keycode, num_keycodes), NULL);
+    if (reply == NULL)
+        errx(EXIT_FAILURE, "Could not get the keyboard mapping");
+
+    free(keysyms);
+    keysyms_per_keycode = reply->keysyms_per_keycode;
+    size_t size = xcb_get_keyboard_mapping_keysyms_length(reply) * sizeof(xcb_keysym_t);
+    if ((keysyms = malloc(size)) == NULL)
+        err(EXIT_FAILURE, "malloc()");
+    memcpy(keysyms, xcb_get_keyboard_mapping_keysyms(reply), size);
+    free(reply);
+}
+
+/*
+ * Finds the keycode producing the given key symbol, on the first (plain) or
+ * second (shifted) level. Returns false if the mapping has no such key.
+ *
+ */
+static bool find_key(xkb_keysym_t keysym, xcb_keycode_t *keycode, bool *shift) {
+    for (int level = 0; level < 2 && level < keysyms_per_keycode; level++) {
+        for (int c = 0; c < num_keycodes; c++) {
+            if (keysyms[c * keysyms_per_keycode + level] != keysym)
+                continue;
+            *keycode = min_keycode + c;
+            *shift = (level == 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void fake_key(uint8_t type, xcb_keycode_t keycode) {
+    xcb_test_fake_input(conn, type, keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+}
+
+/*
+ * Injects a press (type == XCB_KEY_PRESS) or release of the key producing the
+ * given key symbol, along with shift if necessary.
+ *
+ */
+static void fake_keysym(uint8_t type, xkb_keysym_t keysym) {
+    xcb_keycode_t keycode, shift_keycode;
+    bool shift, unused;
+
+    if (!find_key(keysym, &keycode, &shift))
+        errx(EXIT_FAILURE, "No key produces keysym 0x%" PRIx32 " in the current keymap", keysym);
+    if (shift && !find_key(XKB_KEY_Shift_L, &shift_keycode, &unused))
+        errx(EXIT_FAILURE, "No shift key in the current keymap");
+
+    if (shift && type == XCB_KEY_PRESS)
+        fake_key(XCB_KEY_PRESS, shift_keycode);
+    fake_key(type, keycode);
+    if (shift && type == XCB_KEY_RELEASE)
+        fake_key(XCB_KEY_RELEASE, shift_keycode);
+}
+
+/*
+ * Injects a press and release of the key producing the given key symbol,
+ * while holding the given modifier (unless it is XKB_KEY_NoSymbol). The
+ * requests are only sent with the next flush.
+ *
+ */
+static void type_key_with(xkb_keysym_t modifier, xkb_keysym_t keysym) {
+    if (modifier != XKB_KEY_NoSymbol)
+        fake_keysym(XCB_KEY_PRESS, modifier);
+    fake_keysym(XCB_KEY_PRESS, keysym);
+    fake_keysym(XCB_KEY_RELEASE, keysym);
+    if (modifier != XKB_KEY_NoSymbol)
+        fake_keysym(XCB_KEY_RELEASE, modifier);
+}
+
+static void type_key(xkb_keysym_t keysym) {
+    type_key_with(XKB_KEY_NoSymbol, keysym);
+}
+
+/*
+ * Writes a gradient image of the given size, either as PNG or as raw image in
+ * one of the formats of i3lock --raw.
+ *
+ */
+static int cmd_image(int argc, char *argv[]) {
+    /* Byte offsets of red, green and blue per pixel, like in i3lock.c */
+    static const struct {
+        const char *name;
+        int bpp, red, green, blue;
+    } formats[] = {
+        {"rgb", 3, 0, 1, 2},
+        {"rgbx", 4, 0, 1, 2},
+        {"xrgb", 4, 1, 2, 3},
+        {"bgr", 3, 2, 1, 0},
+        {"bgrx", 4, 2, 1, 0},
+        {"xbgr", 4, 3, 2, 1},
+    };
+    int width, height;
+
+    if (argc != 3 || sscanf(argv[0], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+        usage();
+    const char *format = argv[1];
+    const char *path = argv[2];
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+        errx(EXIT_FAILURE, "Could not create a %dx%d image: %s", width, height,
+             cairo_status_to_string(cairo_surface_status(surface)));
+    cairo_surface_flush(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    for (int y = 0; y < height; y++) {
+        uint32_t *row = (uint32_t *)(data + y * stride);
+        for (int x = 0; x < width; x++)
+            row[x] = ((x * 255 / width) << 16) | ((y * 255 / height) << 8) | 0x80;
+    }
+    cairo_surface_mark_dirty(surface);
+
+    if (strcmp(format, "png") == 0) {
+        cairo_status_t status = cairo_surface_write_to_png(surface, path);
+        if (status != CAIRO_STATUS_SUCCESS)
+            errx(EXIT_FAILURE, "Could not write %s: %s", path, cairo_status_to_string(status));
+        cairo_surface_destroy(surface);
+        return EXIT_SUCCESS;
+    }
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        err(EXIT_FAILURE, "Could not open %s", path);
+
+    if (strcmp(format, "native") == 0) {
+        /* The native format is what cairo uses for RGB24. */
+        for (int y = 0; y < height; y++)
+            fwrite(data + y * stride, 4, width, out);
+    } else {
+        size_t f;
+        for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+            if (strcmp(format, formats[f].name) == 0)
+                break;
+        if (f == sizeof(formats) / sizeof(formats[0]))
+            usage();
+
+        unsigned char pixel[4] = {0};
+        for (int y = 0; y < height; y++) {
+            const uint32_t *row = (const uint32_t *)(data + y * stride);
+            for (int x = 0; x < width; x++) {
+                pixel[formats[f].red] = (row[x] >> 16) & 0xff;
+                pixel[formats[f].green] = (row[x] >> 8) & 0xff;
+                pixel[formats[f].blue] = row[x] & 0xff;
+                fwrite(pixel, formats[f].bpp, 1, out);
+            }
+        }
+    }
+
+    if (fclose(out) != 0)
+        err(EXIT_FAILURE, "Could not write %s", path);
+    cairo_surface_destroy(surface);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Starts i3lock (which should be given -n, so that it does not fork). If
+ * stamp_path is not NULL, the CLOCK_MONOTONIC time right before exec() is
+ * written to it, so that the driver can compute latencies from i3lock's trace.
+ *
+ */
+static pid_t spawn(char *argv[], const char *stamp_path) {
+    pid_t pid = fork();
+    if (pid == -1)
+        err(EXIT_FAILURE, "fork()");
+    if (pid != 0)
+        return pid;
+
+    close(xcb_get_file_descriptor(conn));
+
+    if (stamp_path != NULL) {
+        FILE *stamp = fopen(stamp_path, "w");
+        if (stamp == NULL)
+            err(EXIT_FAILURE, "Could not open %s", stamp_path);
+        fprintf(stamp, "%" PRIu64 "\n", now_ns());
+        if (fclose(stamp) != 0)
+            err(EXIT_FAILURE, "Could not write %s", stamp_path);
+    }
+
+    execvp(argv[0], argv);
+    err(EXIT_FAILURE, "Could not execute %s", argv[0]);
+}
+
+/*
+ * Presses Return until i3lock exits, which unlocks it once it locked (with
+ * the mock authentication backend accepting any password). Key presses
+ * before the keyboard is grabbed just go to the root window.
+ *
+ * Returns the exit status of i3lock.
+ *
+ */
+static int unlock(pid_t pid, const char *name) {
+    int status;
+
+    uint64_t deadline = now_ns() + (uint64_t)RUN_TIMEOUT_S * 1000000000;
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (now_ns() > deadline) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            errx(EXIT_FAILURE, "%s did not unlock within %d seconds", name, RUN_TIMEOUT_S);
+        }
+        type_key(XKB_KEY_Return);
+        xcb_flush(conn);
+        sleep_ms(UNLOCK_INTERVAL_MS);
+    }
+
+    if (WIFSIGNALED(status))
+        errx(EXIT_FAILURE, "%s was killed by signal %d", name, WTERMSIG(status));
+    return WEXITSTATUS(status);
+}
+
+/*
+ * Waits until i3lock grabbed the keyboard, which we notice by our own grab
+ * failing, and then a bit longer, until it handles key presses.
+ *
+ */
+static void wait_locked(pid_t pid, const char *name) {
+    uint64_t deadline = now_ns() + (uint64_t)RUN_TIMEOUT_S * 1000000000;
+
+    for (;;) {
+        xcb_grab_keyboard_reply_t *reply = xcb_grab_keyboard_reply(
+            conn,
+            xcb_grab_keyboard(conn, false, screen->root, XCB_CURRENT_TIME,
+                              XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC),
+            NULL);
+        uint8_t status = (reply != NULL ? reply->status : XCB_GRAB_STATUS_INVALID_TIME);
+        free(reply);
+
+        if (status == XCB_GRAB_STATUS_ALREADY_GRABBED)
+            break;
+        if (status == XCB_GRAB_STATUS_SUCCESS) {
+            xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+            xcb_flush(conn);
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            errx(EXIT_FAILURE, "%s exited before locking", name);
+        if (now_ns() > deadline) {
+            kill(pid, SIGKILL);
+            errx(EXIT_FAILURE, "%s did not lock within %d seconds", name, RUN_TIMEOUT_S);
+        }
+        sleep_ms(5);
+    }
+
+    /* The pointer might still be grabbed after the keyboard. */
+    sleep_ms(200);
+}
+
+/*
+ * Fetches the current contents of the watched area from the X server.
+ *
+ */
+static xcb_get_image_reply_t *snapshot(void) {
+    xcb_get_image_reply_t *reply = xcb_get_image_reply(
+        conn,
+        xcb_get_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, screen->root,
+                      watch.x, watch.y, watch.width, watch.height, UINT32_MAX),
+        NULL);
+    if (reply == NULL)
+        errx(EXIT_FAILURE, "Could not get the contents of the screen");
+    return reply;
+}
+
+/*
+ * Polls the watched area until it differs from (or, if same is true, equals)
+ * reference. Returns the time in microseconds from since until the X server
+ * sent those contents, or -1 if that did not happen within timeout_ms.
+ *
+ */
+static int64_t wait_for_contents(xcb_get_image_reply_t *reference, bool same, uint64_t since, long timeout_ms) {
+    uint64_t deadline = since + (uint64_t)timeout_ms * 1000000;
+    int length = xcb_get_image_data_length(reference);
+
+    for (;;) {
+        xcb_get_image_reply_t *current = snapshot();
+        uint64_t received = now_ns();
+        bool changed = (xcb_get_image_data_length(current) != length ||
+                        memcmp(xcb_get_image_data(current), xcb_get_image_data(reference), length) != 0);
+        free(current);
+
+        if (changed != same)
+            return (int64_t)(received - since) / 1000;
+        if (received > deadline)
+            return -1;
+    }
+}
+
+static int64_t wait_for_change(xcb_get_image_reply_t *before, uint64_t since) {
+    return wait_for_contents(before, false, since, KEY_TIMEOUT_MS);
+}
+
+/*
+ * Types the given key and waits for the indicator to change, see
+ * wait_for_change().
+ *
+ */
+static int64_t measure_key(xkb_keysym_t modifier, xkb_keysym_t keysym) {
+    xcb_get_image_reply_t *before = snapshot();
+    type_key_with(modifier, keysym);
+    xcb_flush(conn);
+    int64_t latency = wait_for_change(before, now_ns());
+    free(before);
+    return latency;
+}
+
+/*
+ * If COUNT_ALLOC_FILE is set, i3lock is expected to run with count-alloc.so
+ * preloaded, which keeps the number of heap allocations i3lock made while
+ * handling key presses (see check_key_allocations() in i3lock.c) in that
+ * file. Creates the file and returns the (shared) counter, or NULL.
+ *
+ */
+static const volatile unsigned long *map_allocation_count(void) {
+    const char *path = getenv("COUNT_ALLOC_FILE");
+    if (path == NULL)
+        return NULL;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(unsigned long)) == -1)
+        err(EXIT_FAILURE, "Could not create %s", path);
+    void *map = mmap(NULL, sizeof(unsigned long), PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        err(EXIT_FAILURE, "Could not map %s", path);
+    close(fd);
+    return map;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t *sorted, int n, int p) {
+    if (n == 0)
+        return -1;
+    int index = (n * p + 99) / 100 - 1;
+    return sorted[index < 0 ? 0 : index];
+}
+
+/*
+ * Starts i3lock, waits until it locked and measures the time from injecting a
+ * key press until the indicator changed, for the given case and number of
+ * key presses. Prints one CSV line:
+ * case,count,missed,p50_us,p90_us,p99_us,max_us
+ *
+ * With COUNT_ALLOC_FILE (see map_allocation_count()), the number of heap
+ * allocations i3lock made while handling the measured key presses (including
+ * the typed prefixes and the frames they caused, but not reading the events)
+ * and the number of key presses which allocated are appended:
+ * ...,allocations,allocating_keys
+ *
+ * The time ends when the reply to our GetImage request showed the change, so
+ * it includes (up to) one round trip to the X server. Xvfb has no vblank, so
+ * this is when the pixels would be scanned out at the earliest.
+ *
+ */
+static int cmd_keys(int argc, char *argv[]) {
+    const key_case_t *kc = NULL;
+    int count, x, y, width, height;
+
+    if (argc < 4 ||
+        sscanf(argv[1], "%d", &count) != 1 || count <= 0 ||
+        sscanf(argv[2], "%d,%d,%dx%d", &x, &y, &width, &height) != 4)
+        usage();
+    for (size_t c = 0; c < sizeof(key_cases) / sizeof(key_cases[0]); c++)
+        if (strcmp(argv[0], key_cases[c].name) == 0)
+            kc = &key_cases[c];
+    if (kc == NULL)
+        usage();
+    watch = (xcb_rectangle_t){x, y, width, height};
+
+    connect_x11();
+    load_keyboard_mapping();
+    const volatile unsigned long *allocation_count = map_allocation_count();
+
+    pid_t pid = spawn(argv + 3, NULL);
+    wait_locked(pid, argv[3]);
+
+    int64_t *latencies = calloc(count, sizeof(int64_t));
+    if (latencies == NULL)
+        err(EXIT_FAILURE, "calloc()");
+    int measured = 0, missed = 0, added = 0;
+    unsigned long allocations = 0;
+    int allocating_keys = 0;
+
+    for (int c = 0; c < WARMUP_KEYS + count; c++) {
+        unsigned long allocations_before = (allocation_count != NULL ? *allocation_count : 0);
+
+        if (kc->prefix != XKB_KEY_NoSymbol) {
+            if (kc->prefix_changes) {
+                if (measure_key(XKB_KEY_NoSymbol, kc->prefix) == -1)
+                    errx(EXIT_FAILURE, "typing the prefix did not change the indicator");
+            } else {
+                type_key(kc->prefix);
+                xcb_flush(conn);
+            }
+            sleep_ms(KEY_INTERVAL_MS);
+        }
+
+        int64_t latency = measure_key(kc->modifier, kc->key);
+        if (c >= WARMUP_KEYS) {
+            if (latency == -1)
+                missed++;
+            else
+                latencies[measured++] = latency;
+        }
+        sleep_ms(KEY_INTERVAL_MS);
+
+        if (kc->adds && ++added == CLEAR_INTERVAL) {
+            measure_key(XKB_KEY_NoSymbol, XKB_KEY_Escape);
+            sleep_ms(KEY_INTERVAL_MS);
+            added = 0;
+        }
+
+        if (allocation_count != NULL && c >= WARMUP_KEYS && *allocation_count != allocations_before) {
+            allocations += *allocation_count - allocations_before;
+            allocating_keys++;
+        }
+    }
+
+    int status = unlock(pid, argv[3]);
+    xcb_disconnect(conn);
+
+    qsort(latencies, measured, sizeof(int64_t), compare_latencies);
+    printf("%s,%d,%d,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64,
+           kc->name, count, missed,
+           percentile(latencies, measured, 50), percentile(latencies, measured, 90),
+           percentile(latencies, measured, 99), percentile(latencies, measured, 100));
+    if (allocation_count != NULL)
+        printf(",%lu,%d", allocations, allocating_keys);
+    printf("\n");
+    free(latencies);
+    return status;
+}
+
+/*
+ * Starts i3lock, waits until it locked and injects count key presses at the
+ * given rate (an even count), alternating between a and BackSpace, so that the
+ * input never grows and the indicator never hides. Then Escape is typed, and
+ * we wait for the indicator to disappear: this only happens once i3lock
+ * handled all the keys before, so the time it takes shows whether a backlog
+ * built up. Prints
+ * one CSV line:
+ * keys_per_second,count,sent_keys_per_second,drain_us
+ *
+ * Whether keys were dropped is told by i3lock's trace, which counts the
+ * key_normal, key_backspace and key_clear latencies.
+ *
+ */
+static int cmd_stress(int argc, char *argv[]) {
+    int rate, count, x, y, width, height;
+
+    if (argc < 4 ||
+        sscanf(argv[0], "%d", &rate) != 1 || rate <= 0 ||
+        sscanf(argv[1], "%d", &count) != 1 || count <= 0 || count % 2 != 0 ||
+        sscanf(argv[2], "%d,%d,%dx%d", &x, &y, &width, &height) != 4)
+        usage();
+    watch = (xcb_rectangle_t){x, y, width, height};
+
+    connect_x11();
+    load_keyboard_mapping();
+
+    pid_t pid = spawn(argv + 3, NULL);
+    wait_locked(pid, argv[3]);
+
+    /* Locked, without the indicator. */
+    xcb_get_image_reply_t *hidden = snapshot();
+
+    uint64_t start = now_ns();
+    for (int c = 0; c < count; c++) {
+        uint64_t due = start + (uint64_t)c * 1000000000 / rate;
+        struct timespec ts = {due / 1000000000, due % 1000000000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        type_key(c % 2 == 0 ? XKB_KEY_a : XKB_KEY_BackSpace);
+        xcb_flush(conn);
+    }
+    uint64_t sent = now_ns();
+
+    type_key(XKB_KEY_Escape);
+    xcb_flush(conn);
+    /* If i3lock did not even show the indicator yet, it still being hidden
+     * does not mean anything. */
+    int64_t drain = wait_for_contents(hidden, false, sent, DRAIN_TIMEOUT_MS);
+    if (drain != -1)
+        drain = wait_for_contents(hidden, true, sent, DRAIN_TIMEOUT_MS);
+    free(hidden);
+    if (drain == -1) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        errx(EXIT_FAILURE, "%s did not catch up within %d ms", argv[3], DRAIN_TIMEOUT_MS);
+    }
+
+    int status = unlock(pid, argv[3]);
+    xcb_disconnect(conn);
+
+    printf("%d,%d,%.0f,%" PRId64 "\n", rate, count, count / ((sent - start) / 1e9), drain);
+    return status;
+}
+
+/*
+ * Counts the pixels of the root window which do not show i3lock's default
+ * (white) background.
+ *
+ */
+static long uncovered_pixels(void) {
+    xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(
+        conn, xcb_get_geometry(conn, screen->root), NULL);
+    if (geometry == NULL)
+        errx(EXIT_FAILURE, "Could not get the size of the root window");
+    watch = (xcb_rectangle_t){0, 0, geometry->width, geometry->height};
+    free(geometry);
+
+    /* With depth 24, every pixel takes 32 bits. */
+    xcb_get_image_reply_t *image = snapshot();
+    const uint32_t *pixels = (const uint32_t *)xcb_get_image_data(image);
+    int n = xcb_get_image_data_length(image) / 4;
+    long uncovered = 0;
+    for (int c = 0; c < n; c++)
+        if ((pixels[c] & 0xffffff) != 0xffffff)
+            uncovered++;
+    free(image);
+    return uncovered;
+}
+
+/*
+ * Starts i3lock (with its default white background), waits until it locked,
+ * runs the given command to reconfigure the screen (e.g. xrandr --rotate) and
+ * checks that i3lock still covers the whole screen afterwards. Prints the
+ * size of the root window and the number of uncovered pixels, and fails if
+ * there are any.
+ *
+ */
+static int cmd_cover(int argc, char *argv[]) {
+    if (argc < 2)
+        usage();
+
+    connect_x11();
+    load_keyboard_mapping();
+
+    pid_t pid = spawn(argv + 1, NULL);
+    wait_locked(pid, argv[1]);
+
+    int status = system(argv[0]);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        errx(EXIT_FAILURE, "%s failed", argv[0]);
+    }
+
+    /* Let i3lock handle all the events first, so that we do not see a
+     * covered screen which it then uncovers again. */
+    sleep_ms(SETTLE_MS);
+    uint64_t deadline = now_ns() + (uint64_t)COVER_TIMEOUT_MS * 1000000;
+    long uncovered;
+    while ((uncovered = uncovered_pixels()) > 0 && now_ns() < deadline)
+        sleep_ms(50);
+
+    status = unlock(pid, argv[1]);
+    xcb_disconnect(conn);
+
+    printf("%dx%d,%ld\n", watch.width, watch.height, uncovered);
+    return (uncovered > 0 ? EXIT_FAILURE : status);
+}
+
+/*
+ * Starts i3lock, writing the time of exec() to the stamp file, and unlocks it
+ * again, see spawn() and unlock().
+ *
+ */
+static int cmd_run(int argc, char *argv[]) {
+    if (argc < 2)
+        usage();
+
+    connect_x11();
+    load_keyboard_mapping();
+
+    pid_t pid = spawn(argv + 1, argv[0]);
+    int status = unlock(pid, argv[1]);
+    xcb_disconnect(conn);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2)
+        usage();
+
+    if (strcmp(argv[1], "image") == 0)
+        return cmd_image(argc - 2, argv + 2);
+    if (strcmp(argv[1], "run") == 0)
+        return cmd_run(argc - 2, argv + 2);
+    if (strcmp(argv[1], "keys") == 0)
+        return cmd_keys(argc - 2, argv + 2);
+    if (strcmp(argv[1], "stress") == 0)
+        return cmd_stress(argc - 2, argv + 2);
+    if (strcmp(argv[1], "cover") == 0)
+        return cmd_cover(argc - 2, argv + 2);
+    usage();
+    return EXIT_FAILURE;
+}
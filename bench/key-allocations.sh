@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# Checks that i3lock does not allocate heap memory while handling key presses
+# and redrawing the unlock indicator. i3lock is locked on Xvfb with
+# count-alloc.so preloaded, which counts every malloc() and friends (so an
+# allocation which is freed again still counts), and key presses are injected
+# with XTest (see cmd_keys() in i3lock-bench.c). Fails if any measured key
+# press of any case allocated.
+#
+# "No allocations" covers what i3lock's main thread does from the moment the
+# KeyPress event was read until handle_key_press() returned, plus rendering
+# the frame which shows the key press (including cairo and libxcb requests).
+# Not covered are xcb_poll_for_event() itself (libxcb allocates every event
+# it returns, including the KeyRelease and XkbStateNotify events), other
+# events, timers such as the one hiding the indicator, and other threads
+# (e.g. loading the compose table), see check_key_allocations() in i3lock.c.
+#
+# Needs Xvfb, an i3lock built with --enable-mock-auth and --disable-sanitizers
+# (the sanitizers replace malloc() themselves) and count-alloc.so. Run it with
+# "make check-allocations", or directly:
+#
+#   bench/key-allocations.sh -i ./i3lock -b bench/i3lock-bench -l bench/count-alloc.so
+#
+# The cases can be changed with these environment variables (the defaults
+# are shown):
+#
+#   CASES="normal backspace escape ctrl_u"
+#   COUNT=200             (measured key presses per case)
+#
+
+set -eu
+
+i3lock=./i3lock
+bench=bench/i3lock-bench
+lib=bench/count-alloc.so
+
+while getopts "i:b:l:" opt; do
+    case "$opt" in
+        i) i3lock="$OPTARG" ;;
+        b) bench="$OPTARG" ;;
+        l) lib="$OPTARG" ;;
+        *) echo "Syntax: $0 [-i i3lock] [-b i3lock-bench] [-l count-alloc.so]" >&2; exit 1 ;;
+    esac
+done
+
+: "${CASES:=normal backspace escape ctrl_u}"
+: "${COUNT:=200}"
+
+. "$(dirname "$0")/xvfb.sh"
+require Xvfb
+
+tmp=$(mktemp -d)
+trap 'stop_xvfb; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+# LD_PRELOAD needs a path, not a file name.
+case "$lib" in
+    /*) ;;
+    *) lib="$PWD/$lib" ;;
+esac
+
+resolution=1920x1080
+start_xvfb "$resolution"
+watch="810,390,300x300"
+
+COUNT_ALLOC_FILE="$tmp/allocations"
+export COUNT_ALLOC_FILE
+
+failed=0
+for case in $CASES; do
+    if ! "$bench" keys "$case" "$COUNT" "$watch" \
+        env LD_PRELOAD="$lib" "$i3lock" -n --auth-backend=mock:0:accept > "$tmp/keys.csv"; then
+        echo "$0: i3lock failed (was it built with --enable-mock-auth?)" >&2
+        exit 1
+    fi
+
+    # case,count,missed,p50,p90,p99,max,allocations,allocating_keys
+    allocations=$(cut -d, -f8 "$tmp/keys.csv")
+    allocating_keys=$(cut -d, -f9 "$tmp/keys.csv")
+    if [ -z "$allocations" ]; then
+        echo "$0: no allocation count, is $lib preloaded?" >&2
+        exit 1
+    fi
+    if [ "$allocations" -ne 0 ]; then
+        echo "FAIL: $case: $allocating_keys of $COUNT key presses allocated ($allocations allocations)"
+        failed=1
+    else
+        echo "PASS: $case: $COUNT key presses, no allocations"
+    fi
+done
+
+exit "$failed"
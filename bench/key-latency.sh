@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# Measures how long it takes from a key press until the unlock indicator shows
+# its effect. i3lock is locked on Xvfb and key presses are injected with XTest
+# (see cmd_keys() in i3lock-bench.c), for each number of RandR monitors and
+# each class of key:
+#
+#   normal     a printable key
+#   backspace  BackSpace (after typing a key)
+#   escape     Escape, clearing the input (after typing a key)
+#   ctrl_u     Ctrl+u, clearing the input (after typing a key)
+#   compose    the e of the compose sequence dead_acute e (with the keymap
+#              switched to us(intl) by setxkbmap)
+#
+# Each line of the CSV has the percentiles of three latencies:
+#
+#   pixels_*   until the changed indicator could be read back from the X
+#              server by the harness (plus up to one GetImage round trip).
+#              This is the closest to visible pixels we get: Xvfb has no
+#              display, so there is no vblank or scanout to wait for.
+#   flush_*    from i3lock's trace: until the frame was flushed to the X
+#              server (xcb_flush() in render_frame()), i.e. without the time
+#              the X server takes to draw it.
+#   photon_*   from i3lock's trace, only with I3LOCK_ARGS=--present: until
+#              the X server reported the frame as presented (key_to_photon,
+#              which does not tell apart classes of keys, so this includes
+#              the keys typed before the measured ones).
+#
+# Needs Xvfb, xrandr, setxkbmap and an i3lock built with --enable-mock-auth.
+# Run it with "make bench-keys", or directly:
+#
+#   bench/key-latency.sh -i ./i3lock -b bench/i3lock-bench -o key-latency.csv
+#
+# The matrix can be changed with these environment variables (the defaults
+# are shown):
+#
+#   RESOLUTION=3840x1080
+#   MONITORS="1 2 3 4 5 6"
+#   CASES="normal backspace escape ctrl_u compose"
+#   COUNT=200             (measured key presses per case)
+#   I3LOCK_ARGS=          (passed to i3lock, e.g. --present)
+#
+
+set -eu
+
+i3lock=./i3lock
+bench=bench/i3lock-bench
+output=key-latency.csv
+
+while getopts "i:b:o:" opt; do
+    case "$opt" in
+        i) i3lock="$OPTARG" ;;
+        b) bench="$OPTARG" ;;
+        o) output="$OPTARG" ;;
+        *) echo "Syntax: $0 [-i i3lock] [-b i3lock-bench] [-o output.csv]" >&2; exit 1 ;;
+    esac
+done
+
+: "${RESOLUTION:=3840x1080}"
+: "${MONITORS:=1 2 3 4 5 6}"
+: "${CASES:=normal backspace escape ctrl_u compose}"
+: "${COUNT:=200}"
+: "${I3LOCK_ARGS:=}"
+
+. "$(dirname "$0")/xvfb.sh"
+require Xvfb xrandr setxkbmap
+
+tmp=$(mktemp -d)
+trap 'stop_xvfb; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+# The compose table depends on the locale.
+LC_ALL=${BENCH_LOCALE:-en_US.UTF-8}
+export LC_ALL
+
+# Prints the given percentile of the given latency from the (CSV) trace.
+from_trace() {
+    awk -F, -v name="$1.$2" '$2 == name { printf "%s", $8; exit }' "$tmp/trace.csv"
+}
+
+echo "monitors,case,count,missed,pixels_p50_us,pixels_p90_us,pixels_p99_us,pixels_max_us,flush_p50_us,flush_p99_us,photon_p50_us,photon_p99_us" > "$output"
+
+width=${RESOLUTION%x*}
+height=${RESOLUTION#*x}
+
+for monitors in $MONITORS; do
+    start_xvfb "$RESOLUTION"
+    set_monitors "$RESOLUTION" "$monitors"
+
+    # The indicator is in the center of each monitor, we watch the first one.
+    each=$((width / monitors))
+    size=300
+    if [ "$size" -gt "$each" ]; then
+        size=$each
+    fi
+    watch="$(((each - size) / 2)),$(((height - size) / 2)),${size}x${size}"
+
+    for case in $CASES; do
+        trace_name=key_$case
+        case "$case" in
+            escape | ctrl_u) trace_name=key_clear ;;
+            compose) setxkbmap -layout us -variant intl ;;
+        esac
+
+        # shellcheck disable=SC2086
+        if ! "$bench" keys "$case" "$COUNT" "$watch" "$i3lock" -n --auth-backend=mock:0:accept \
+            --trace-startup="$tmp/trace.csv" --trace-format=csv $I3LOCK_ARGS > "$tmp/keys.csv"; then
+            echo "$0: i3lock failed (was it built with --enable-mock-auth?)" >&2
+            exit 1
+        fi
+        echo "$monitors,$(cat "$tmp/keys.csv"),$(from_trace "$trace_name" p50),$(from_trace "$trace_name" p99),$(from_trace key_to_photon p50),$(from_trace key_to_photon p99)" >> "$output"
+
+        if [ "$case" = compose ]; then
+            setxkbmap -layout us
+        fi
+    done
+
+    stop_xvfb
+done
+
+echo "Wrote $output"
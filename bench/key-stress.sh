@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# Checks that i3lock keeps up with bursts of key presses, like the ones of a
+# hardware token or a password manager typing a password. i3lock is locked on
+# Xvfb and key presses are injected with XTest at a fixed rate (see
+# cmd_stress() in i3lock-bench.c). Fails if
+#
+#   - any key was dropped: i3lock's trace has to count as many key_normal and
+#     key_backspace latencies as keys were injected, and one key_clear,
+#   - a redraw backlog built up: once all keys were sent, i3lock has to show
+#     the effect of the last one within MAX_DRAIN_MS, and no key may take
+#     longer than MAX_LATENCY_MS until the frame showing it was flushed.
+#
+# Needs Xvfb and an i3lock built with --enable-mock-auth. Run it with
+# "make check-stress", or directly:
+#
+#   bench/key-stress.sh -i ./i3lock -b bench/i3lock-bench
+#
+# The test can be changed with these environment variables (the defaults are
+# shown):
+#
+#   RATE=10000            (key presses per second)
+#   COUNT=20000           (key presses, an even number)
+#   MAX_DRAIN_MS=100
+#   MAX_LATENCY_MS=50
+#   I3LOCK_ARGS=          (passed to i3lock, e.g. --present)
+#
+
+set -eu
+
+i3lock=./i3lock
+bench=bench/i3lock-bench
+
+while getopts "i:b:" opt; do
+    case "$opt" in
+        i) i3lock="$OPTARG" ;;
+        b) bench="$OPTARG" ;;
+        *) echo "Syntax: $0 [-i i3lock] [-b i3lock-bench]" >&2; exit 1 ;;
+    esac
+done
+
+: "${RATE:=10000}"
+: "${COUNT:=20000}"
+: "${MAX_DRAIN_MS:=100}"
+: "${MAX_LATENCY_MS:=50}"
+: "${I3LOCK_ARGS:=}"
+
+. "$(dirname "$0")/xvfb.sh"
+require Xvfb
+
+tmp=$(mktemp -d)
+trap 'stop_xvfb; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+# Prints the given line (e.g. key_normal.count) of the (CSV) trace.
+from_trace() {
+    awk -F, -v name="$1" '$2 == name { printf "%s", $8; exit }' "$tmp/trace.csv"
+}
+
+resolution=1920x1080
+start_xvfb "$resolution"
+watch="810,390,300x300"
+
+# shellcheck disable=SC2086
+if ! "$bench" stress "$RATE" "$COUNT" "$watch" "$i3lock" -n --auth-backend=mock:0:accept \
+    --trace-startup="$tmp/trace.csv" --trace-format=csv $I3LOCK_ARGS > "$tmp/stress.csv"; then
+    echo "$0: i3lock failed (was it built with --enable-mock-auth?)" >&2
+    exit 1
+fi
+
+# keys_per_second,count,sent_keys_per_second,drain_us
+sent_rate=$(cut -d, -f3 "$tmp/stress.csv")
+drain_us=$(cut -d, -f4 "$tmp/stress.csv")
+echo "Sent $COUNT key presses at $sent_rate/s (asked for $RATE/s), i3lock caught up after ${drain_us}us"
+
+failed=0
+
+check_count() {
+    counted=$(from_trace "$1.count")
+    if [ "${counted:-0}" -ne "$2" ]; then
+        echo "FAIL: i3lock handled ${counted:-0} instead of $2 $1 key presses"
+        failed=1
+    fi
+}
+
+check_count key_normal $((COUNT / 2))
+check_count key_backspace $((COUNT / 2))
+check_count key_clear 1
+
+if [ "$drain_us" -gt $((MAX_DRAIN_MS * 1000)) ]; then
+    echo "FAIL: i3lock took ${drain_us}us to catch up after the last key, more than ${MAX_DRAIN_MS}ms"
+    failed=1
+fi
+
+for name in key_normal key_backspace; do
+    max_us=$(from_trace "$name.max")
+    echo "$name: p50 $(from_trace "$name.p50")us, p99 $(from_trace "$name.p99")us, max ${max_us}us"
+    if [ "${max_us:-0}" -gt $((MAX_LATENCY_MS * 1000)) ]; then
+        echo "FAIL: a $name key press took ${max_us}us until its frame, more than ${MAX_LATENCY_MS}ms"
+        failed=1
+    fi
+done
+
+if [ "$failed" -eq 0 ]; then
+    echo "PASS: no keys dropped, no redraw backlog"
+fi
+exit "$failed"
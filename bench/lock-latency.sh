@@ -0,0 +1,109 @@
+#!/bin/sh
+#
+# Measures how long i3lock takes to lock the screen: from exec() until the
+# first MapNotify (exec_to_map_notify_us), until pointer and keyboard are
+# grabbed (exec_to_grab_success_us) and until the X server processed the first
+# complete frame (exec_to_first_frame_us). Each configuration of the matrix
+# below runs on a fresh Xvfb, and every run becomes one line of the CSV.
+#
+# Needs Xvfb, xrandr and an i3lock built with --enable-mock-auth. Run it with
+# "make bench", or directly:
+#
+#   bench/lock-latency.sh -i ./i3lock -b bench/i3lock-bench -o lock-latency.csv
+#
+# The matrix can be changed with these environment variables (the defaults
+# are shown):
+#
+#   RESOLUTIONS="1920x1080 3840x2160"
+#   MONITORS="1 2 4"      (RandR monitors side by side, see xrandr --setmonitor)
+#   IMAGES="none png:screen png:1280x720 png:3840x2160 rgb:screen native:screen"
+#                         (png or a --raw pixel format, and the image size)
+#   TILING="no yes"       (-t, only for configurations with an image)
+#   RUNS=5
+#
+
+set -eu
+
+i3lock=./i3lock
+bench=bench/i3lock-bench
+output=lock-latency.csv
+
+while getopts "i:b:o:" opt; do
+    case "$opt" in
+        i) i3lock="$OPTARG" ;;
+        b) bench="$OPTARG" ;;
+        o) output="$OPTARG" ;;
+        *) echo "Syntax: $0 [-i i3lock] [-b i3lock-bench] [-o output.csv]" >&2; exit 1 ;;
+    esac
+done
+
+: "${RESOLUTIONS:=1920x1080 3840x2160}"
+: "${MONITORS:=1 2 4}"
+: "${IMAGES:=none png:screen png:1280x720 png:3840x2160 rgb:screen native:screen}"
+: "${TILING:=no yes}"
+: "${RUNS:=5}"
+
+. "$(dirname "$0")/xvfb.sh"
+require Xvfb xrandr
+
+tmp=$(mktemp -d)
+trap 'stop_xvfb; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+# Prints the time in microseconds from the exec() stamp to the first mark of
+# the given name in the (CSV) trace.
+since_exec() {
+    awk -F, -v stamp="$(cat "$tmp/stamp")" -v name="$1" \
+        '$2 == name && $3 == 1 { printf "%.1f", ($4 - stamp) / 1000; exit }' "$tmp/trace.csv"
+}
+
+echo "resolution,monitors,image,image_size,tiling,run,exec_to_map_notify_us,exec_to_grab_success_us,exec_to_first_frame_us" > "$output"
+
+for resolution in $RESOLUTIONS; do
+    for monitors in $MONITORS; do
+        start_xvfb "$resolution"
+        set_monitors "$resolution" "$monitors"
+
+        for image in $IMAGES; do
+            format=${image%%:*}
+            size=${image#*:}
+            if [ "$size" = screen ]; then
+                size=$resolution
+            fi
+            args=
+            if [ "$format" = none ]; then
+                size=
+            else
+                "$bench" image "$size" "$format" "$tmp/image"
+                args="-i $tmp/image"
+                if [ "$format" != png ]; then
+                    args="$args --raw=$size:$format"
+                fi
+            fi
+
+            for tiling in $TILING; do
+                tiling_args=
+                if [ "$tiling" = yes ]; then
+                    [ "$format" != none ] || continue
+                    tiling_args=-t
+                fi
+
+                run=1
+                while [ "$run" -le "$RUNS" ]; do
+                    # shellcheck disable=SC2086
+                    if ! "$bench" run "$tmp/stamp" "$i3lock" -n --auth-backend=mock:0:accept \
+                        --trace-startup="$tmp/trace.csv" --trace-format=csv $args $tiling_args; then
+                        echo "$0: i3lock failed (was it built with --enable-mock-auth?)" >&2
+                        exit 1
+                    fi
+                    echo "$resolution,$monitors,$format,$size,$tiling,$run,$(since_exec map_notify),$(since_exec grab_success),$(since_exec first_frame)" >> "$output"
+                    run=$((run + 1))
+                done
+            done
+        done
+
+        stop_xvfb
+    done
+done
+
+echo "Wrote $output"
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Checks that i3lock keeps covering the whole screen when the output is
+# rotated while it is locked. Rotating by 90 or 270 degrees swaps the width
+# and the height of the screen, which i3lock has to follow (see the
+# RRScreenChangeNotify handling in xcb_check_cb()). i3lock is locked on Xvfb,
+# the output is rotated with xrandr, and every pixel of the screen has to show
+# i3lock's white background afterwards (see cmd_cover() in i3lock-bench.c).
+#
+# Needs Xvfb, xrandr and an i3lock built with --enable-mock-auth. Run it with
+# "make check-rotation", or directly:
+#
+#   bench/screen-rotation.sh -i ./i3lock -b bench/i3lock-bench
+#
+# Exits with 77 (skipped) if the X server cannot rotate its output.
+#
+# The rotations can be changed with this environment variable (the default is
+# shown):
+#
+#   ROTATIONS="left right inverted"
+#
+
+set -eu
+
+i3lock=./i3lock
+bench=bench/i3lock-bench
+
+while getopts "i:b:" opt; do
+    case "$opt" in
+        i) i3lock="$OPTARG" ;;
+        b) bench="$OPTARG" ;;
+        *) echo "Syntax: $0 [-i i3lock] [-b i3lock-bench]" >&2; exit 1 ;;
+    esac
+done
+
+: "${ROTATIONS:=left right inverted}"
+
+. "$(dirname "$0")/xvfb.sh"
+require Xvfb xrandr
+
+tmp=$(mktemp -d)
+trap 'stop_xvfb; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+resolution=1920x1080
+
+failed=0
+for rotation in $ROTATIONS; do
+    start_xvfb "$resolution"
+
+    if ! xrandr --output screen --rotate "$rotation" 2> /dev/null ||
+        ! xrandr --output screen --rotate normal 2> /dev/null; then
+        echo "SKIP: the X server cannot rotate its output"
+        exit 77
+    fi
+
+    # size,uncovered_pixels
+    if ! "$bench" cover "xrandr --output screen --rotate $rotation" \
+        "$i3lock" -n --auth-backend=mock:0:accept > "$tmp/cover.csv" && [ ! -s "$tmp/cover.csv" ]; then
+        echo "$0: i3lock failed (was it built with --enable-mock-auth?)" >&2
+        exit 1
+    fi
+    size=$(cut -d, -f1 "$tmp/cover.csv")
+    uncovered=$(cut -d, -f2 "$tmp/cover.csv")
+    if [ "$uncovered" -ne 0 ]; then
+        echo "FAIL: $rotation: $uncovered pixels of the $size screen are not covered"
+        failed=1
+    else
+        echo "PASS: $rotation: i3lock covers the $size screen"
+    fi
+
+    stop_xvfb
+done
+
+exit "$failed"
@@ -0,0 +1,59 @@
+#
+# Functions shared by the benchmark drivers, which source this file. They
+# expect $tmp to be a temporary directory and $0 to be the driver.
+#
+
+xvfb_pid=
+
+# Starts Xvfb with a screen of the given resolution and sets DISPLAY.
+start_xvfb() {
+    : > "$tmp/display"
+    Xvfb -displayfd 3 -screen 0 "${1}x24" -nolisten tcp 3> "$tmp/display" 2> "$tmp/xvfb.log" &
+    xvfb_pid=$!
+    tries=0
+    while [ ! -s "$tmp/display" ]; do
+        tries=$((tries + 1))
+        if [ "$tries" -gt 500 ] || ! kill -0 "$xvfb_pid" 2>/dev/null; then
+            echo "$0: Xvfb did not start:" >&2
+            cat "$tmp/xvfb.log" >&2
+            exit 1
+        fi
+        sleep 0.01
+    done
+    DISPLAY=":$(cat "$tmp/display")"
+    export DISPLAY
+}
+
+stop_xvfb() {
+    [ -n "$xvfb_pid" ] || return 0
+    kill "$xvfb_pid" 2>/dev/null || true
+    wait "$xvfb_pid" 2>/dev/null || true
+    xvfb_pid=
+}
+
+# Splits the screen of the given resolution into the given number of RandR
+# monitors side by side. The first one takes over Xvfb's only output.
+set_monitors() {
+    width=${1%x*}
+    height=${1#*x}
+    each=$((width / $2))
+    m=0
+    while [ "$m" -lt "$2" ]; do
+        out=none
+        if [ "$m" -eq 0 ]; then
+            out=screen
+        fi
+        xrandr --setmonitor "bench$m" "$each/$((each / 4))x$height/$((height / 4))+$((m * each))+0" "$out"
+        m=$((m + 1))
+    done
+}
+
+# Exits unless all the given programs are installed.
+require() {
+    for tool in "$@"; do
+        if ! command -v "$tool" >/dev/null; then
+            echo "$0: $tool is required" >&2
+            exit 1
+        fi
+    done
+}
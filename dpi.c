@@ -10,20 +10,70 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <xcb/xcb_xrm.h>
 #include "xcb.h"
 #include "i3lock.h"
+#include "trace.h"
 
 extern bool debug_mode;
 
 static long dpi;
 
+static xcb_get_property_cookie_t resources_cookie;
+static bool resources_requested = false;
+
 extern xcb_screen_t *screen;
 
 static long init_dpi_fallback(void) {
     return (double)screen->height_in_pixels * 25.4 / (double)screen->height_in_millimeters;
 }
 
+/*
+ * Requests the RESOURCE_MANAGER property, so that init_dpi() does not have to
+ * wait for it if there was other work to do in the meantime.
+ *
+ */
+void prefetch_dpi(void) {
+    if (conn == NULL || resources_requested) {
+        return;
+    }
+
+    resources_cookie = xcb_get_property_unchecked(conn, false, screen->root, XCB_ATOM_RESOURCE_MANAGER,
+                                                  XCB_ATOM_STRING, 0, 16 * 1024 * 1024);
+    resources_requested = true;
+}
+
+/*
+ * Returns the resource database: the RESOURCE_MANAGER property requested by
+ * prefetch_dpi() if set, otherwise whatever xcb-util-xrm falls back to (e.g.
+ * ~/.Xresources).
+ *
+ */
+static xcb_xrm_database_t *load_resources(void) {
+    xcb_xrm_database_t *database = NULL;
+
+    prefetch_dpi();
+    resources_requested = false;
+
+    trace_round_trip("GetProperty");
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(conn, resources_cookie, NULL);
+    if (reply != NULL && xcb_get_property_value_length(reply) > 0) {
+        char *resources = strndup(xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+        if (resources != NULL) {
+            database = xcb_xrm_database_from_string(resources);
+            free(resources);
+        }
+    }
+    free(reply);
+
+    if (database == NULL) {
+        trace_round_trip("xcb_xrm_database_from_default");
+        database = xcb_xrm_database_from_default(conn);
+    }
+    return database;
+}
+
 /*
  * Initialize the DPI setting.
  * This will use the 'Xft.dpi' X resource if available and fall back to
@@ -37,7 +87,7 @@ void init_dpi(void) {
         goto init_dpi_end;
     }
 
-    database = xcb_xrm_database_from_default(conn);
+    database = load_resources();
     if (database == NULL) {
         DEBUG("Failed to open the resource database.\n");
         goto init_dpi_end;
@@ -1,5 +1,11 @@
 #pragma once
 
+/**
+ * Requests the X resources needed by init_dpi() without waiting for them.
+ *
+ */
+void prefetch_dpi(void);
+
 /**
  * Initialize the DPI setting.
  * This will use the 'Xft.dpi' X resource if available and fall back to
@@ -12,22 +12,24 @@
 #include <stdlib.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <xcb/xcb.h>
 #include <xcb/xkb.h>
+#include <xcb/xcbext.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <assert.h>
-#ifdef __OpenBSD__
-#include <bsd_auth.h>
-#else
-#include <security/pam_appl.h>
-#endif
 #include <getopt.h>
 #include <string.h>
+#include <pthread.h>
 #include <ev.h>
 #include <sys/mman.h>
 #include <xkbcommon/xkbcommon.h>
@@ -47,53 +49,124 @@
 #include "unlock_indicator.h"
 #include "randr.h"
 #include "dpi.h"
+#include "trace.h"
+#include "auth.h"
+#include "present.h"
 
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
 #define START_TIMER(timer_obj, timeout, callback) \
-    timer_obj = start_timer(timer_obj, timeout, callback)
+    start_timer(&(timer_obj), timeout, callback)
 #define STOP_TIMER(timer_obj) \
-    timer_obj = stop_timer(timer_obj)
+    stop_timer(&(timer_obj))
 
 typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
-static void input_done(void);
+static void input_done(const char *pw);
+static void unlock_screen(void);
+static void clear_input(void);
+static void finish_compose_loading(void);
+static void poll_grab(void);
+static void grab_hint(void);
+static void maybe_detach(void);
 
 char color[7] = "ffffff";
 uint32_t last_resolution[2];
 xcb_window_t win;
 static xcb_cursor_t cursor;
-#ifndef __OpenBSD__
-static pam_handle_t *pam_handle;
-#endif
 int input_position = 0;
 /* Holds the password you enter (in UTF-8). */
 static char password[512];
+/* A password submitted with enter while the previous one was still being
+ * verified (or before we were locked), and its length (-1 if there is none).
+ * It is verified as soon as the pending verification failed (see
+ * auth_failed()) or we are locked (see grab_finished()). */
+static char queued_password[sizeof(password)];
+static int queued_length = -1;
 static bool beep = false;
 bool debug_mode = false;
 bool unlock_indicator = true;
-char *modifier_string = NULL;
+/* Pressed modifiers at the time of a failed attempt, or empty if none. */
+char modifier_string[MODIFIER_STRING_SIZE];
 static bool dont_fork = false;
+/* In daemon mode (--daemon), i3lock sets everything up, but only maps the
+ * window and grabs the input when triggered (see daemon_lock()). After
+ * unlocking, it goes back to waiting for the next trigger. */
+static bool daemon_mode = false;
+/* Whether the screen is currently locked, i.e. the window is mapped and we
+ * hold the grabs. */
+static bool locked = false;
+/* Whether we hold the keyboard grab while still waiting for the pointer grab.
+ * Key presses are handled already, so that nothing typed right after invoking
+ * i3lock gets lost, but the input is only verified once we are locked. */
+static bool keyboard_locked = false;
+static char *daemon_socket_path;
+static pid_t daemon_pid;
+static char *username;
+static xcb_window_t stolen_focus;
+/* Whether we got a MapNotify for our window, see maybe_detach(). */
+static bool window_mapped = false;
 struct ev_loop *main_loop;
-static struct ev_timer *clear_auth_wrong_timeout;
-static struct ev_timer *clear_indicator_timeout;
-static struct ev_timer *discard_passwd_timeout;
+/* All timers are allocated statically and only (re)started, so that handling
+ * a key press does not need to allocate anything. */
+static struct ev_timer clear_auth_wrong_timeout;
+static struct ev_timer clear_indicator_timeout;
+static struct ev_timer discard_passwd_timeout;
+static struct ev_timer redraw_timeout_timer;
+
+/* The authentication helper process (see input_done()) and its result pipe. */
+#define AUTH_RESULT_SUCCESS 'y'
+#define AUTH_RESULT_FAILURE 'n'
+struct auth_result {
+    char status;
+    /* CLOCK_MONOTONIC timestamps around the backend's check, for tracing. */
+    uint64_t backend_begin;
+    uint64_t backend_end;
+};
+static pid_t auth_pid;
+static struct ev_io auth_watcher;
+/* The process running raise_loop() while the screen is locked (or 0). */
+static pid_t raise_pid = 0;
+/* Reaps the helper processes once they exit, see child_exited(). */
+static struct ev_child child_watcher;
+static struct ev_timer auth_timeout_timer;
+/* Seconds after which a hung authentication is given up (--auth-timeout). */
+static int auth_timeout = 0;
+static int auth_trace = -1;
+/* Whether to update the unlock indicator on vblank with Present (--present). */
+static bool use_present = false;
+/* When verification was started and finished, for debug output. */
+static ev_tstamp auth_requested;
+static ev_tstamp auth_finished;
 extern unlock_state_t unlock_state;
 extern auth_state_t auth_state;
 int failed_attempts = 0;
 bool show_failed_attempts = false;
-bool retry_verification = false;
 
 static struct xkb_state *xkb_state;
 static struct xkb_context *xkb_context;
 static struct xkb_keymap *xkb_keymap;
 static struct xkb_compose_table *xkb_compose_table;
 static struct xkb_compose_state *xkb_compose_state;
+/* The compose table is parsed on a worker thread once we are locked (see
+ * maybe_detach()) and installed when it is ready or when the first key is
+ * pressed, whichever happens first. */
+static const char *compose_locale;
+static pthread_t compose_thread;
+static bool compose_started = false;
+static struct ev_async compose_ready;
 static uint8_t xkb_base_event;
+/* Looking the core keyboard up costs a round trip, so we only do that once
+ * (and follow it when it is replaced, see process_xkb_event()). */
+static int32_t keyboard_device_id = -1;
 static uint8_t xkb_base_error;
 static int randr_base = -1;
 
 cairo_surface_t *img = NULL;
+/* The shared memory backing img, if any, so that it can be uploaded to the X
+ * server via MIT-SHM instead of through the socket. */
+shm_image_t *img_shm = NULL;
 bool tile = false;
+image_mode_t image_mode = IMAGE_MODE_NONE;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
 
@@ -108,13 +181,144 @@ void u8_dec(char *s, int *i) {
     (void)(isutf(s[--(*i)]) || isutf(s[--(*i)]) || isutf(s[--(*i)]) || --(*i));
 }
 
+/*
+ * Compiled keymaps, keyed by the names of the XKB components they were built
+ * from (as set by e.g. setxkbmap), so that flipping between layouts does not
+ * fetch and compile the same keymap from the X server over and over.
+ *
+ */
+typedef struct keymap_names {
+    xcb_atom_t keycodes;
+    xcb_atom_t geometry;
+    xcb_atom_t symbols;
+    xcb_atom_t phys_symbols;
+    xcb_atom_t types;
+    xcb_atom_t compat;
+} keymap_names_t;
+
+#define KEYMAP_NAME_DETAILS (XCB_XKB_NAME_DETAIL_KEYCODES | XCB_XKB_NAME_DETAIL_GEOMETRY | XCB_XKB_NAME_DETAIL_SYMBOLS | \
+                             XCB_XKB_NAME_DETAIL_PHYS_SYMBOLS | XCB_XKB_NAME_DETAIL_TYPES | XCB_XKB_NAME_DETAIL_COMPAT)
+
+#define KEYMAP_CACHE_SIZE 4
+
+static struct keymap_cache_entry {
+    keymap_names_t names;
+    struct xkb_keymap *keymap;
+    unsigned int last_used;
+} keymap_cache[KEYMAP_CACHE_SIZE];
+static unsigned int keymap_cache_clock = 0;
+
+/* The labels of the modifiers of xkb_keymap, by index. Modifier masks have 32
+ * bits, so there cannot be more modifiers than that. */
+#define MAX_MODIFIER_LABELS 32
+static const char *modifier_labels[MAX_MODIFIER_LABELS];
+static xkb_mod_index_t num_modifier_labels = 0;
+
+/* The names xkb_keymap was built from, if known. */
+static keymap_names_t keymap_names;
+static bool keymap_names_valid = false;
+
+/* Set when the X server told us that the keymap changed. The keymap is
+ * reloaded once per event loop iteration (or before the next key press), no
+ * matter how many notifications a single setxkbmap call generates. */
+static bool keymap_changed = false;
+
+/*
+ * Gets the names of the XKB components the keymap of the given device was
+ * built from. Costs one round trip, which is still far cheaper than fetching
+ * the whole keymap.
+ *
+ */
+static bool get_keymap_names(int32_t device_id, keymap_names_t *names) {
+    xcb_xkb_get_names_reply_t *reply =
+        xcb_xkb_get_names_reply(conn, xcb_xkb_get_names(conn, device_id, KEYMAP_NAME_DETAILS), NULL);
+    if (reply == NULL)
+        return false;
+
+    /* The value list contains one atom per requested component, in the
+     * order of the bits in KEYMAP_NAME_DETAILS. */
+    bool valid = ((reply->which & KEYMAP_NAME_DETAILS) == KEYMAP_NAME_DETAILS);
+    if (valid)
+        memcpy(names, xcb_xkb_get_names_value_list(reply), sizeof(*names));
+    free(reply);
+    return valid;
+}
+
+static struct xkb_keymap *keymap_cache_lookup(const keymap_names_t *names) {
+    for (int i = 0; i < KEYMAP_CACHE_SIZE; i++) {
+        struct keymap_cache_entry *entry = &keymap_cache[i];
+        if (entry->keymap != NULL && memcmp(&entry->names, names, sizeof(*names)) == 0) {
+            entry->last_used = ++keymap_cache_clock;
+            return xkb_keymap_ref(entry->keymap);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Stores the keymap in the cache, replacing the entry for the same names (its
+ * keymap has changed) or else the least recently used one.
+ *
+ */
+static void keymap_cache_store(const keymap_names_t *names, struct xkb_keymap *keymap) {
+    struct keymap_cache_entry *victim = &keymap_cache[0];
+    for (int i = 0; i < KEYMAP_CACHE_SIZE; i++) {
+        struct keymap_cache_entry *entry = &keymap_cache[i];
+        if (entry->keymap == NULL || memcmp(&entry->names, names, sizeof(*names)) == 0) {
+            victim = entry;
+            break;
+        }
+        if (entry->last_used < victim->last_used)
+            victim = entry;
+    }
+
+    xkb_keymap_unref(victim->keymap);
+    victim->names = *names;
+    victim->keymap = xkb_keymap_ref(keymap);
+    victim->last_used = ++keymap_cache_clock;
+}
+
+/*
+ * Looks up the (human-readable) names of the modifiers of the current keymap,
+ * which are shown after a failed attempt.
+ *
+ */
+static void update_modifier_labels(void) {
+    num_modifier_labels = xkb_keymap_num_mods(xkb_keymap);
+    if (num_modifier_labels > MAX_MODIFIER_LABELS)
+        num_modifier_labels = MAX_MODIFIER_LABELS;
+
+    for (xkb_mod_index_t idx = 0; idx < num_modifier_labels; idx++) {
+        const char *mod_name = xkb_keymap_mod_get_name(xkb_keymap, idx);
+        modifier_labels[idx] = mod_name;
+        if (mod_name == NULL)
+            continue;
+
+        /* Replace certain xkb names with nicer, human-readable ones. */
+        if (strcmp(mod_name, XKB_MOD_NAME_CAPS) == 0)
+            mod_name = "Caps Lock";
+        else if (strcmp(mod_name, XKB_MOD_NAME_ALT) == 0)
+            mod_name = "Alt";
+        else if (strcmp(mod_name, XKB_MOD_NAME_NUM) == 0)
+            mod_name = "Num Lock";
+        else if (strcmp(mod_name, XKB_MOD_NAME_LOGO) == 0)
+            mod_name = "Super";
+        modifier_labels[idx] = mod_name;
+    }
+}
+
 /*
  * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
  * Necessary so that we can properly let xkbcommon track the keyboard state and
  * translate keypresses to utf-8.
  *
+ * Unless map_changed is set (i.e. the server told us that the keymap was
+ * modified, e.g. by xmodmap), the keymap is only fetched if the component
+ * names differ from the ones of the current keymap and no cached keymap was
+ * built from them. The keyboard state is always refreshed.
+ *
  */
-static bool load_keymap(void) {
+static bool load_keymap(bool map_changed) {
     if (xkb_context == NULL) {
         if ((xkb_context = xkb_context_new(0)) == NULL) {
             fprintf(stderr, "[i3lock] could not create xkbcommon context\n");
@@ -122,39 +326,108 @@ static bool load_keymap(void) {
         }
     }
 
-    xkb_keymap_unref(xkb_keymap);
-
-    int32_t device_id = xkb_x11_get_core_keyboard_device_id(conn);
+    int trace = trace_begin("load_keymap");
+    int32_t device_id = keyboard_device_id;
     DEBUG("device = %d\n", device_id);
-    if ((xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
-        fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
-        return false;
+
+    keymap_names_t names = {0};
+    trace_round_trip("XkbGetNames");
+    bool have_names = get_keymap_names(device_id, &names);
+    bool same_names = (have_names && keymap_names_valid &&
+                       memcmp(&names, &keymap_names, sizeof(names)) == 0);
+
+    struct xkb_keymap *keymap = NULL;
+    if (same_names && !map_changed) {
+        keymap = xkb_keymap_ref(xkb_keymap);
+    } else if (have_names && !same_names) {
+        if ((keymap = keymap_cache_lookup(&names)) != NULL)
+            DEBUG("using cached keymap\n");
+    }
+
+    if (keymap == NULL) {
+        trace_round_trip("xkb_x11_keymap_new_from_device");
+        if ((keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
+            fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
+            trace_end(trace);
+            return false;
+        }
+        if (have_names)
+            keymap_cache_store(&names, keymap);
     }
 
+    trace_round_trip("xkb_x11_state_new_from_device");
     struct xkb_state *new_state =
-        xkb_x11_state_new_from_device(xkb_keymap, conn, device_id);
+        xkb_x11_state_new_from_device(keymap, conn, device_id);
+    trace_end(trace);
     if (new_state == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
+        xkb_keymap_unref(keymap);
         return false;
     }
 
+    xkb_keymap_unref(xkb_keymap);
+    xkb_keymap = keymap;
+    keymap_names = names;
+    keymap_names_valid = have_names;
+    update_modifier_labels();
+
     xkb_state_unref(xkb_state);
     xkb_state = new_state;
 
     return true;
 }
 
+/*
+ * Reloads the keymap if the X server reported changes since the last call.
+ *
+ */
+static void flush_keymap_changes(void) {
+    if (!keymap_changed)
+        return;
+
+    keymap_changed = false;
+    (void)load_keymap(true);
+}
+
 /*
  * Loads the XKB compose table from the given locale.
  *
+ * This runs on a worker thread during startup (see main()), so it uses its own
+ * xkbcommon context. Returns the table, or NULL on error.
+ *
  */
-static bool load_compose_table(const char *locale) {
-    xkb_compose_table_unref(xkb_compose_table);
+static void *load_compose_table(void *arg) {
+    const char *locale = arg;
+    struct xkb_context *context;
+    struct xkb_compose_table *table;
+    int trace = trace_begin("load_compose_table");
+
+    if ((context = xkb_context_new(0)) == NULL) {
+        fprintf(stderr, "[i3lock] could not create xkbcommon context\n");
+        trace_end(trace);
+        return NULL;
+    }
 
-    if ((xkb_compose_table = xkb_compose_table_new_from_locale(xkb_context, locale, 0)) == NULL) {
+    /* The table keeps its own reference to the context. */
+    if ((table = xkb_compose_table_new_from_locale(context, locale, 0)) == NULL)
         fprintf(stderr, "[i3lock] xkb_compose_table_new_from_locale failed\n");
+
+    xkb_context_unref(context);
+    trace_end(trace);
+    return table;
+}
+
+/*
+ * Switches to the given compose table (as returned by load_compose_table()),
+ * taking over the reference.
+ *
+ */
+static bool set_compose_table(struct xkb_compose_table *table) {
+    if (table == NULL)
         return false;
-    }
+
+    xkb_compose_table_unref(xkb_compose_table);
+    xkb_compose_table = table;
 
     struct xkb_compose_state *new_compose_state = xkb_compose_state_new(xkb_compose_table, 0);
     if (new_compose_state == NULL) {
@@ -173,16 +446,16 @@ static bool load_compose_table(const char *locale) {
  * cold-boot attacks.
  *
  */
-static void clear_password_memory(void) {
+static void clear_memory(char *buffer, size_t size) {
 #ifdef __OpenBSD__
     /* Use explicit_bzero(3) which was explicitly designed not to be
      * optimized out by the compiler. */
-    explicit_bzero(password, strlen(password));
+    explicit_bzero(buffer, size);
 #else
     /* A volatile pointer to the password buffer to prevent the compiler from
      * optimizing this out. */
-    volatile char *vpassword = password;
-    for (size_t c = 0; c < sizeof(password); c++)
+    volatile char *vpassword = buffer;
+    for (size_t c = 0; c < size; c++)
         /* We store a non-random pattern which consists of the (irrelevant)
          * index plus (!) the value of the beep variable. This prevents the
          * compiler from optimizing the calls away, since the value of 'beep'
@@ -191,29 +464,91 @@ static void clear_password_memory(void) {
 #endif
 }
 
-ev_timer *start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        ev_timer_set(timer_obj, timeout, 0.);
-        ev_timer_start(main_loop, timer_obj);
-    } else {
-        /* When there is no memory, we just don’t have a timeout. We cannot
-         * exit() here, since that would effectively unlock the screen. */
-        timer_obj = calloc(sizeof(struct ev_timer), 1);
-        if (timer_obj) {
-            ev_timer_init(timer_obj, callback, timeout, 0.);
-            ev_timer_start(main_loop, timer_obj);
+static void clear_password_memory(void) {
+    clear_memory(password, sizeof(password));
+}
+
+/*
+ * Drops the queued password (if any).
+ *
+ */
+static void clear_queued_password(void) {
+    if (queued_length == -1)
+        return;
+    clear_memory(queued_password, sizeof(queued_password));
+    queued_length = -1;
+}
+
+/*
+ * Starts verifying the queued password (if any). The queue is emptied first,
+ * since this attempt might fail right away. Empty passwords were already
+ * checked by skip_without_validation() when they were queued.
+ *
+ */
+static void verify_queued_password(void) {
+    int length = queued_length;
+    queued_length = -1;
+    if (length >= 0) {
+        DEBUG("verifying the queued password\n");
+        input_done(queued_password);
+    }
+    clear_memory(queued_password, sizeof(queued_password));
+}
+
+/*
+ * Password managers and hardware tokens type dozens of keys within a few
+ * milliseconds. All key presses which are queued at once are handled as one
+ * batch (see xcb_check_cb()): timers (re)started while handling them are only
+ * started once the batch is done, and the redraw scheduler renders only the
+ * final state.
+ *
+ */
+#define MAX_DEFERRED_TIMERS 8
+static bool in_key_batch = false;
+static ev_timer *deferred_timers[MAX_DEFERRED_TIMERS];
+static int num_deferred_timers = 0;
+
+/*
+ * (Re)starts the given one-shot timer. Stopping a timer which never ran is
+ * fine with libev.
+ *
+ */
+static void start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
+    ev_timer_stop(main_loop, timer_obj);
+    ev_timer_init(timer_obj, callback, timeout, 0.);
+    if (in_key_batch) {
+        for (int i = 0; i < num_deferred_timers; i++)
+            if (deferred_timers[i] == timer_obj)
+                return;
+        if (num_deferred_timers < MAX_DEFERRED_TIMERS) {
+            deferred_timers[num_deferred_timers++] = timer_obj;
+            return;
         }
     }
-    return timer_obj;
+    ev_timer_start(main_loop, timer_obj);
 }
 
-ev_timer *stop_timer(ev_timer *timer_obj) {
-    if (timer_obj) {
-        ev_timer_stop(main_loop, timer_obj);
-        free(timer_obj);
+static void stop_timer(ev_timer *timer_obj) {
+    ev_timer_stop(main_loop, timer_obj);
+    for (int i = 0; i < num_deferred_timers; i++) {
+        if (deferred_timers[i] != timer_obj)
+            continue;
+        deferred_timers[i] = deferred_timers[--num_deferred_timers];
+        break;
     }
-    return NULL;
+}
+
+static void begin_key_batch(void) {
+    in_key_batch = true;
+}
+
+static void end_key_batch(int keys) {
+    in_key_batch = false;
+    for (int i = 0; i < num_deferred_timers; i++)
+        ev_timer_start(main_loop, deferred_timers[i]);
+    num_deferred_timers = 0;
+    if (keys > 1)
+        DEBUG("handled a batch of %d key presses\n", keys);
 }
 
 /*
@@ -224,7 +559,21 @@ static void finish_input(void) {
     password[input_position] = '\0';
     unlock_state = STATE_KEY_PRESSED;
     redraw_screen();
-    input_done();
+    input_done(password);
+}
+
+/*
+ * Enter was pressed while the previous password is still being verified:
+ * queues the input (replacing any queued before), to be verified once the
+ * pending verification failed, and starts a fresh input.
+ *
+ */
+static void queue_input(void) {
+    DEBUG("queueing the input until the pending verification is done\n");
+    memcpy(queued_password, password, input_position);
+    queued_password[input_position] = '\0';
+    queued_length = input_position;
+    clear_input();
 }
 
 /*
@@ -238,24 +587,11 @@ static void clear_auth_wrong(EV_P_ ev_timer *w, int revents) {
     redraw_screen();
 
     /* Clear modifier string. */
-    if (modifier_string != NULL) {
-        free(modifier_string);
-        modifier_string = NULL;
-    }
-
-    /* Now free this timeout. */
-    STOP_TIMER(clear_auth_wrong_timeout);
-
-    /* retry with input done during auth verification */
-    if (retry_verification) {
-        retry_verification = false;
-        finish_input();
-    }
+    modifier_string[0] = '\0';
 }
 
 static void clear_indicator_cb(EV_P_ ev_timer *w, int revents) {
     clear_indicator();
-    STOP_TIMER(clear_indicator_timeout);
 }
 
 static void clear_input(void) {
@@ -266,86 +602,55 @@ static void clear_input(void) {
 
 static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
     clear_input();
-    STOP_TIMER(discard_passwd_timeout);
 }
 
-static void input_done(void) {
-    STOP_TIMER(clear_auth_wrong_timeout);
-    auth_state = STATE_AUTH_VERIFY;
-    unlock_state = STATE_STARTED;
-    redraw_screen();
-
-#ifdef __OpenBSD__
-    struct passwd *pw;
-
-    if (!(pw = getpwuid(getuid())))
-        errx(1, "unknown uid %u.", getuid());
-
-    if (auth_userokay(pw->pw_name, NULL, NULL, password) != 0) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
+static bool skip_without_validation(void) {
+    if (input_position != 0)
+        return false;
 
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
-        return;
-    }
-#else
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
+    if (skip_repeated_empty_password || ignore_empty_password)
+        return true;
 
-        /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
-         * Related to credentials pam_end() needs to be called to cleanup any temporary
-         * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
-         * refresh of the credentials failed. */
-        pam_setcred(pam_handle, PAM_REFRESH_CRED);
-        pam_end(pam_handle, PAM_SUCCESS);
+    return false;
+}
 
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
-        return;
-    }
-#endif
+/*
+ * Stops waiting for the authentication helper.
+ *
+ */
+static void stop_auth_helper(void) {
+    ev_io_stop(main_loop, &auth_watcher);
+    close(auth_watcher.fd);
+    STOP_TIMER(auth_timeout_timer);
+    trace_end(auth_trace);
+    auth_pid = 0;
+}
 
+static void auth_failed(void) {
     if (debug_mode)
         fprintf(stderr, "Authentication failure\n");
 
     /* Get state of Caps and Num lock modifiers, to be displayed in
      * STATE_AUTH_WRONG state */
-    xkb_mod_index_t idx, num_mods;
-    const char *mod_name;
-
-    num_mods = xkb_keymap_num_mods(xkb_keymap);
-
-    for (idx = 0; idx < num_mods; idx++) {
-        if (!xkb_state_mod_index_is_active(xkb_state, idx, XKB_STATE_MODS_EFFECTIVE))
-            continue;
-
-        mod_name = xkb_keymap_mod_get_name(xkb_keymap, idx);
-        if (mod_name == NULL)
+    size_t len = 0;
+    modifier_string[0] = '\0';
+    for (xkb_mod_index_t idx = 0; idx < num_modifier_labels; idx++) {
+        if (modifier_labels[idx] == NULL ||
+            !xkb_state_mod_index_is_active(xkb_state, idx, XKB_STATE_MODS_EFFECTIVE))
             continue;
 
-        /* Replace certain xkb names with nicer, human-readable ones. */
-        if (strcmp(mod_name, XKB_MOD_NAME_CAPS) == 0)
-            mod_name = "Caps Lock";
-        else if (strcmp(mod_name, XKB_MOD_NAME_ALT) == 0)
-            mod_name = "Alt";
-        else if (strcmp(mod_name, XKB_MOD_NAME_NUM) == 0)
-            mod_name = "Num Lock";
-        else if (strcmp(mod_name, XKB_MOD_NAME_LOGO) == 0)
-            mod_name = "Super";
-
-        char *tmp;
-        if (modifier_string == NULL) {
-            if (asprintf(&tmp, "%s", mod_name) != -1)
-                modifier_string = tmp;
-        } else if (asprintf(&tmp, "%s, %s", modifier_string, mod_name) != -1) {
-            free(modifier_string);
-            modifier_string = tmp;
+        int n = snprintf(modifier_string + len, sizeof(modifier_string) - len, "%s%s",
+                         (len > 0 ? ", " : ""), modifier_labels[idx]);
+        if (n < 0 || (size_t)n >= sizeof(modifier_string) - len) {
+            /* Better no label at all than half of one. */
+            modifier_string[len] = '\0';
+            break;
         }
+        len += n;
     }
 
     auth_state = STATE_AUTH_WRONG;
     failed_attempts += 1;
-    clear_input();
     if (unlock_indicator)
         redraw_screen();
 
@@ -363,21 +668,241 @@ static void input_done(void) {
         xcb_bell(conn, 100);
         xcb_flush(conn);
     }
+
+    /* The user already submitted another password while we were verifying.
+     * Whatever was typed after that stays in the input buffer. Verifying it
+     * replaces the wrong state right away, so render that (and the new number
+     * of failed attempts) for at least one frame first: the redraw scheduler
+     * paces the next one. */
+    if (queued_length >= 0 && unlock_indicator)
+        redraw_screen_now();
+    verify_queued_password();
 }
 
-static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
+/*
+ * The authentication helper reported its result (or died, in which case we
+ * read EOF and treat that as a failure).
+ *
+ */
+static void auth_done_cb(EV_P_ ev_io *w, int revents) {
+    struct auth_result result = {AUTH_RESULT_FAILURE, 0, 0};
+    ssize_t n;
+
+    while ((n = read(w->fd, &result, sizeof(result))) == -1 && errno == EINTR)
+        ;
+    stop_auth_helper();
+    auth_finished = ev_time();
+    if (n != sizeof(result))
+        result.status = AUTH_RESULT_FAILURE;
+
+    /* The time spent in the backend only, as opposed to the authenticate
+     * phase, which includes starting the helper. */
+    if (result.backend_begin != 0)
+        trace_phase("auth_backend", result.backend_begin, result.backend_end);
+
+    if (result.status == AUTH_RESULT_SUCCESS) {
+        DEBUG("successfully authenticated\n");
+        unlock_screen();
+        return;
+    }
+    auth_failed();
+}
+
+/*
+ * The authentication helper did not report back within --auth-timeout.
+ *
+ */
+static void auth_timeout_cb(EV_P_ ev_timer *w, int revents) {
+    fprintf(stderr, "[i3lock] Authentication timed out after %d seconds\n", auth_timeout);
+    kill(auth_pid, SIGKILL);
+    stop_auth_helper();
+    auth_failed();
+}
+
+/*
+ * One of our helper processes exited. Authentication helpers can outlive
+ * their attempt (when they were killed after --auth-timeout, or while they
+ * refresh credentials after a successful one), so several might be around at
+ * once. The watcher therefore takes care of any child, which libev reaps
+ * (waitpid()) before calling us.
+ *
+ */
+static void child_exited(EV_P_ ev_child *w, int revents) {
+    DEBUG("child %d exited (status 0x%x)%s\n", w->rpid, w->rstatus,
+          (w->rpid == auth_pid ? ", it was the current authentication helper" : ""));
+    /* Do not signal the pid in release_screen() once it could be reused. */
+    if (w->rpid == raise_pid)
+        raise_pid = 0;
+}
+
+/*
+ * Starts verifying the password. The authentication backend (which might take
+ * seconds, e.g. with pam_faildelay or network logins) runs in a fork()ed
+ * helper process, which sends the result back through a pipe, so that we keep
+ * handling events (and redrawing) in the meantime. The helper gets its own
+ * copy of the password, so the input buffer is cleared right away and keys
+ * typed while verifying are collected for the next attempt.
+ *
+ * pw is either the input buffer or the queued password (see queue_input()).
+ *
+ */
+static void input_done(const char *pw) {
+    int fds[2] = {-1, -1};
+    pid_t pid;
+
+    STOP_TIMER(clear_auth_wrong_timeout);
+    auth_requested = ev_time();
+    auth_state = STATE_AUTH_VERIFY;
+    unlock_state = STATE_STARTED;
+    modifier_string[0] = '\0';
     redraw_screen();
-    STOP_TIMER(w);
+
+    /* The compose worker (started once we are locked) needs to be done before
+     * we fork(): the helper runs the authentication backend, which might
+     * allocate or dlopen() while the worker holds a lock. */
+    finish_compose_loading();
+
+    if (pipe(fds) == -1 || (pid = fork()) == -1) {
+        /* Better block the event loop than lock the user out. */
+        DEBUG("Could not start authentication helper: %s\n", strerror(errno));
+        if (fds[0] != -1) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        redraw_screen_now();
+        bool success = auth_backend()->check(pw);
+        auth_finished = ev_time();
+        if (pw == password)
+            clear_input();
+        if (success) {
+            DEBUG("successfully authenticated\n");
+            unlock_screen();
+            auth_backend()->finish();
+            /* The backend was finished, prepare it for the next lock. */
+            if (daemon_mode && !auth_backend()->init(username))
+                errx(EXIT_FAILURE, "Could not initialize the %s authentication backend", auth_backend()->name);
+            return;
+        }
+        auth_failed();
+        return;
+    }
+
+    if (pid == 0) {
+        /* Child: memory locks are not inherited by fork(). */
+#if defined(__linux__)
+        (void)mlock(password, sizeof(password));
+        (void)mlock(queued_password, sizeof(queued_password));
+#endif
+        close(fds[0]);
+        close(xcb_get_file_descriptor(conn));
+
+        struct auth_result result;
+        result.backend_begin = trace_now();
+        result.status = (auth_backend()->check(pw) ? AUTH_RESULT_SUCCESS : AUTH_RESULT_FAILURE);
+        result.backend_end = trace_now();
+        clear_password_memory();
+        clear_memory(queued_password, sizeof(queued_password));
+
+        /* Report the result first: refreshing credentials (e.g. kerberos
+         * tickets) can take a while, but the user should not have to stare
+         * at the lock screen meanwhile. We just continue in the background
+         * (after our parent possibly exited already). */
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        close(fds[1]);
+        if (result.status == AUTH_RESULT_SUCCESS)
+            auth_backend()->finish();
+        _exit(written == sizeof(result) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    (void)fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    auth_pid = pid;
+    auth_trace = trace_begin("authenticate");
+    if (pw == password)
+        clear_input();
+
+    ev_io_init(&auth_watcher, auth_done_cb, fds[0], EV_READ);
+    ev_io_start(main_loop, &auth_watcher);
+    if (auth_timeout > 0)
+        START_TIMER(auth_timeout_timer, auth_timeout, auth_timeout_cb);
 }
 
-static bool skip_without_validation(void) {
-    if (input_position != 0)
-        return false;
+/* Provided by bench/count-alloc.so if it was preloaded (LD_PRELOAD): counts
+ * the calling thread's heap allocations while enabled, and returns the number
+ * counted so far. */
+extern void i3lock_count_allocations(bool enable) __attribute__((weak));
+extern unsigned long i3lock_allocation_count(void) __attribute__((weak));
 
-    if (skip_repeated_empty_password || ignore_empty_password)
-        return true;
+static bool counting = false;
+static unsigned long allocations_before;
 
-    return false;
+/*
+ * Starts counting the allocations of the main thread, see
+ * check_key_allocations().
+ *
+ */
+void start_counting_allocations(void) {
+    if (i3lock_count_allocations == NULL || counting)
+        return;
+    counting = true;
+    allocations_before = i3lock_allocation_count();
+    i3lock_count_allocations(true);
+}
+
+/*
+ * Stops counting and returns the number of allocations since
+ * start_counting_allocations().
+ *
+ */
+unsigned long stop_counting_allocations(void) {
+    if (!counting)
+        return 0;
+    i3lock_count_allocations(false);
+    counting = false;
+    return i3lock_allocation_count() - allocations_before;
+}
+
+bool counting_allocations(void) {
+    return counting;
+}
+
+/*
+ * With --debug (and bench/count-alloc.so preloaded), complains about key
+ * presses which allocated memory, even if it was freed again. Handling a key
+ * is supposed to work with the timers, buffers and surfaces which are already
+ * there. This covers handle_key_press() and the frame it causes, but not
+ * reading the event (libxcb allocates each one) or other threads.
+ *
+ */
+void check_key_allocations(const char *what, unsigned long allocations) {
+    static unsigned int allocating_keys = 0;
+
+    if (allocations == 0)
+        return;
+
+    allocating_keys++;
+    DEBUG("%s allocated %lu times (%u times so far)\n",
+          what, allocations, allocating_keys);
+}
+
+static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
+    redraw_screen();
+}
+
+/* The last keysym of the dead key block (dead_grave is the first), which
+ * older xkbcommon headers do not define yet. */
+#ifndef XKB_KEY_dead_longsolidusoverlay
+#define XKB_KEY_dead_longsolidusoverlay 0xfe93
+#endif
+
+/*
+ * Returns whether the given key symbol starts a compose sequence (dead keys
+ * and the Compose key), i.e. cannot be handled without the compose table.
+ *
+ */
+static bool starts_compose_sequence(xkb_keysym_t ksym) {
+    return (ksym == XKB_KEY_Multi_key ||
+            (ksym >= XKB_KEY_dead_grave && ksym <= XKB_KEY_dead_longsolidusoverlay));
 }
 
 /*
@@ -392,8 +917,17 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     int n;
     bool ctrl;
     bool composed = false;
+    /* For --trace-startup: the time from receiving the key press until the
+     * resulting redraw was flushed to the X server, per class of key. */
+    uint64_t pressed = trace_now();
 
     ksym = xkb_state_key_get_one_sym(xkb_state, event->detail);
+
+    /* Dead keys need the compose table, so we cannot go on without it. Other
+     * keys do not wait for it, compose_ready_cb() installs it once loaded. */
+    if (starts_compose_sequence(ksym))
+        finish_compose_loading();
+
     ctrl = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED);
 
     /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
@@ -431,26 +965,20 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             if ((ksym == XKB_KEY_j || ksym == XKB_KEY_m) && !ctrl)
                 break;
 
-            if (auth_state == STATE_AUTH_WRONG) {
-                retry_verification = true;
-                return;
-            }
-
             if (skip_without_validation()) {
                 clear_input();
                 return;
             }
-            finish_input();
+            /* Verify this input as soon as the pending verification
+             * failed, or once we are locked. */
+            if (auth_state == STATE_AUTH_VERIFY || !locked)
+                queue_input();
+            else
+                finish_input();
             skip_repeated_empty_password = true;
             return;
         default:
             skip_repeated_empty_password = false;
-            // A new password is being entered, but a previous one is pending.
-            // Discard the old one and clear the retry_verification flag.
-            if (retry_verification) {
-                retry_verification = false;
-                clear_input();
-            }
     }
 
     switch (ksym) {
@@ -461,8 +989,10 @@ static void handle_key_press(xcb_key_press_event_t *event) {
                 DEBUG("C-u pressed\n");
                 clear_input();
                 /* Also hide the unlock indicator */
-                if (unlock_indicator)
+                if (unlock_indicator) {
                     clear_indicator();
+                    redraw_screen_latency("key_clear", pressed);
+                }
                 return;
             }
             break;
@@ -484,6 +1014,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
                 START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
                 unlock_state = STATE_NOTHING_TO_DELETE;
                 redraw_screen();
+                redraw_screen_latency("key_backspace", pressed);
                 return;
             }
 
@@ -496,6 +1027,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
             unlock_state = STATE_BACKSPACE_ACTIVE;
             redraw_screen();
+            redraw_screen_latency("key_backspace", pressed);
             unlock_state = STATE_KEY_PRESSED;
             return;
     }
@@ -525,10 +1057,10 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     if (unlock_indicator) {
         unlock_state = STATE_KEY_ACTIVE;
         redraw_screen();
+        redraw_screen_latency((composed ? "key_compose" : "key_normal"), pressed);
         unlock_state = STATE_KEY_PRESSED;
 
-        struct ev_timer *timeout = NULL;
-        START_TIMER(timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
+        START_TIMER(redraw_timeout_timer, TSTAMP_N_SECS(0.25), redraw_timeout);
         STOP_TIMER(clear_indicator_timeout);
     }
 
@@ -576,7 +1108,11 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
 
     DEBUG("process_xkb_event for device %d\n", event->any.deviceID);
 
-    if (event->any.deviceID != xkb_x11_get_core_keyboard_device_id(conn))
+    if (event->any.xkbType == XCB_XKB_NEW_KEYBOARD_NOTIFY &&
+        event->new_keyboard_notify.oldDeviceID == keyboard_device_id)
+        keyboard_device_id = event->new_keyboard_notify.deviceID;
+
+    if (event->any.deviceID != keyboard_device_id)
         return;
 
     /*
@@ -587,11 +1123,11 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
     switch (event->any.xkbType) {
         case XCB_XKB_NEW_KEYBOARD_NOTIFY:
             if (event->new_keyboard_notify.changed & XCB_XKB_NKN_DETAIL_KEYCODES)
-                (void)load_keymap();
+                keymap_changed = true;
             break;
 
         case XCB_XKB_MAP_NOTIFY:
-            (void)load_keymap();
+            keymap_changed = true;
             break;
 
         case XCB_XKB_STATE_NOTIFY:
@@ -607,36 +1143,31 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
 }
 
 /*
- * Called when the properties on the root window change, e.g. when the screen
- * resolution changes. If so we update the window to cover the whole screen
- * and also redraw the image, if any.
+ * Called when the root window was resized (according to the given
+ * ConfigureNotify or RRScreenChangeNotify event) or, if outputs_changed is
+ * set, the RandR configuration changed. We update the window to cover the
+ * whole screen, query the monitors again and redraw the image, if any.
+ *
+ * With RandR, every resize is followed by an RRScreenChangeNotify, so the
+ * monitors are only queried for that one, once per change.
  *
  */
-void handle_screen_resize(void) {
-    xcb_get_geometry_cookie_t geomc;
-    xcb_get_geometry_reply_t *geom;
-    geomc = xcb_get_geometry(conn, screen->root);
-    if ((geom = xcb_get_geometry_reply(conn, geomc, 0)) == NULL)
+static void handle_screen_resize(uint16_t width, uint16_t height, bool outputs_changed) {
+    bool resized = (last_resolution[0] != width || last_resolution[1] != height);
+    if (!resized && !outputs_changed)
         return;
 
-    if (last_resolution[0] == geom->width &&
-        last_resolution[1] == geom->height) {
-        free(geom);
-        return;
-    }
-
-    last_resolution[0] = geom->width;
-    last_resolution[1] = geom->height;
-
-    free(geom);
-
-    redraw_screen();
+    if (resized) {
+        last_resolution[0] = width;
+        last_resolution[1] = height;
 
-    uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-    xcb_configure_window(conn, win, mask, last_resolution);
-    xcb_flush(conn);
+        uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+        xcb_configure_window(conn, win, mask, last_resolution);
+        xcb_flush(conn);
+    }
 
-    randr_query(screen->root);
+    if (outputs_changed || randr_base == -1)
+        randr_query(screen->root);
     redraw_screen();
 }
 
@@ -693,7 +1224,56 @@ static const struct raw_pixel_format raw_fmt_bgr = {3, 2, 1, 0};
 static const struct raw_pixel_format raw_fmt_bgrx = {4, 2, 1, 0};
 static const struct raw_pixel_format raw_fmt_xbgr = {4, 3, 2, 1};
 
-static cairo_surface_t *read_raw_image(const char *image_path, const char *image_raw_format) {
+/*
+ * Creates an RGB24 image surface of the given size whose data lives in an
+ * shm_image_t, which is returned in shm.
+ *
+ */
+static cairo_surface_t *create_shm_image_surface(size_t width, size_t height, shm_image_t **shm) {
+    *shm = NULL;
+    if (width > UINT16_MAX || height > UINT16_MAX)
+        return cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+
+    if ((*shm = shm_image_create(width, height)) == NULL)
+        return cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+
+    return cairo_image_surface_create_for_data((*shm)->data, CAIRO_FORMAT_RGB24,
+                                               width, height, (*shm)->stride);
+}
+
+/*
+ * Moves the data of an (opaque) image surface into shared memory, so that it
+ * can be uploaded via MIT-SHM. Returns the original surface if that is not
+ * possible.
+ *
+ */
+static cairo_surface_t *share_image_surface(cairo_surface_t *src, shm_image_t **shm) {
+    *shm = NULL;
+    if (cairo_image_surface_get_format(src) != CAIRO_FORMAT_RGB24)
+        return src;
+
+    const int width = cairo_image_surface_get_width(src);
+    const int height = cairo_image_surface_get_height(src);
+    cairo_surface_t *dest = create_shm_image_surface(width, height, shm);
+    if (*shm == NULL || cairo_surface_status(dest) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(dest);
+        shm_image_free(NULL, *shm);
+        *shm = NULL;
+        return src;
+    }
+
+    cairo_surface_flush(src);
+    const unsigned char *data = cairo_image_surface_get_data(src);
+    const int stride = cairo_image_surface_get_stride(src);
+    for (int y = 0; y < height; y++)
+        memcpy((*shm)->data + y * (*shm)->stride, data + y * stride, width * 4);
+    cairo_surface_mark_dirty(dest);
+
+    cairo_surface_destroy(src);
+    return dest;
+}
+
+static cairo_surface_t *read_raw_image(const char *image_path, const char *image_raw_format, shm_image_t **shm) {
     cairo_surface_t *img;
 
 #define RAW_PIXFMT_MAXLEN 6
@@ -711,11 +1291,15 @@ static cairo_surface_t *read_raw_image(const char *image_path, const char *image
 #undef STRINGIFY1
 #undef STRINGIFY
 
-    /* Create image surface */
-    img = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+    /* Create image surface, reading the image directly into memory which can
+     * be shared with the X server. */
+    img = create_shm_image_surface(w, h, shm);
     if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
         fprintf(stderr, "Could not create surface: %s\n",
                 cairo_status_to_string(cairo_surface_status(img)));
+        cairo_surface_destroy(img);
+        shm_image_free(NULL, *shm);
+        *shm = NULL;
         return NULL;
     }
     cairo_surface_flush(img);
@@ -729,6 +1313,8 @@ static cairo_surface_t *read_raw_image(const char *image_path, const char *image
         fprintf(stderr, "Could not open image \"%s\": %s\n",
                 image_path, strerror(errno));
         cairo_surface_destroy(img);
+        shm_image_free(NULL, *shm);
+        *shm = NULL;
         return NULL;
     }
 
@@ -758,6 +1344,8 @@ static cairo_surface_t *read_raw_image(const char *image_path, const char *image
             fprintf(stderr, "Unknown raw pixel format: %s\n", pixfmt);
             fclose(f);
             cairo_surface_destroy(img);
+            shm_image_free(NULL, *shm);
+            *shm = NULL;
             return NULL;
         }
 
@@ -773,6 +1361,8 @@ static cairo_surface_t *read_raw_image(const char *image_path, const char *image
                     image_path, strerror(errno));
             fclose(f);
             cairo_surface_destroy(img);
+            shm_image_free(NULL, *shm);
+            *shm = NULL;
             return NULL;
         } else {
             /* Print a warning if the file contains less data than expected,
@@ -816,38 +1406,134 @@ static bool verify_png_image(const char *image_path) {
     return true;
 }
 
-#ifndef __OpenBSD__
 /*
- * Callback function for PAM. We only react on password request callbacks.
+ * Initializes the authentication backend for the given user. Runs on a worker
+ * thread during startup, see main(). The result is NULL if that failed, since
+ * only the main thread may exit.
  *
  */
-static int conv_callback(int num_msg, const struct pam_message **msg,
-                         struct pam_response **resp, void *appdata_ptr) {
-    if (num_msg == 0)
-        return 1;
+static void *start_auth(void *arg) {
+    return (auth_backend()->init(arg) ? arg : NULL);
+}
 
-    /* PAM expects an array of responses, one for each message */
-    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
-        perror("calloc");
-        return 1;
-    }
+/*
+ * The image (-i) to load on a worker thread during startup, see load_image().
+ *
+ */
+struct image_job {
+    char *path;
+    char *raw_format;
 
-    for (int c = 0; c < num_msg; c++) {
-        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
-            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
-            continue;
+    /* Results */
+    cairo_surface_t *img;
+    shm_image_t *shm;
+};
 
-        /* return code is currently not used but should be set to zero */
-        resp[c]->resp_retcode = 0;
-        if ((resp[c]->resp = strdup(password)) == NULL) {
-            perror("strdup");
-            return 1;
+/*
+ * Loads (decodes) the image given by -i, and --raw if specified. Runs on a
+ * worker thread during startup, see main(). In case loading fails, the result
+ * is NULL and we just pretend no -i was specified.
+ *
+ */
+static void *load_image(void *arg) {
+    struct image_job *job = arg;
+    cairo_surface_t *img = NULL;
+    int trace = trace_begin("load_image");
+
+    job->shm = NULL;
+    if (job->raw_format != NULL) {
+        /* Read image. 'read_raw_image' returns NULL on error,
+         * so we don't have to handle errors here. */
+        img = read_raw_image(job->path, job->raw_format, &job->shm);
+    } else if (verify_png_image(job->path)) {
+        img = cairo_image_surface_create_from_png(job->path);
+        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+            fprintf(stderr, "Could not load image \"%s\": %s\n",
+                    job->path, cairo_status_to_string(cairo_surface_status(img)));
+            img = NULL;
+        } else {
+            img = share_image_surface(img, &job->shm);
         }
     }
 
-    return 0;
+    job->img = img;
+    trace_end(trace);
+    return NULL;
+}
+
+/*
+ * Starts fn on a worker thread. If that is not possible, fn is run right away,
+ * so the result (if requested) is the same either way once join_worker()
+ * returned.
+ *
+ */
+static bool start_worker(pthread_t *thread, void *(*fn)(void *), void *arg, void **result) {
+    if (pthread_create(thread, NULL, fn, arg) == 0)
+        return true;
+
+    DEBUG("Could not start worker thread, running synchronously\n");
+    void *ret = fn(arg);
+    if (result != NULL)
+        *result = ret;
+    return false;
+}
+
+/*
+ * Waits for a worker started with start_worker() and stores its result. The
+ * time spent waiting is traced as the given phase.
+ *
+ */
+static void join_worker(const char *name, pthread_t thread, bool started, void **result) {
+    int trace = trace_begin(name);
+    if (started)
+        pthread_join(thread, result);
+    trace_end(trace);
+}
+
+static void *compose_worker(void *arg) {
+    void *table = load_compose_table(arg);
+    ev_async_send(main_loop, &compose_ready);
+    return table;
+}
+
+/*
+ * Starts loading the compose table, unless that already happened. Key presses
+ * are handled without compose support until it is installed, see
+ * finish_compose_loading().
+ *
+ */
+static void start_compose_loading(void) {
+    static bool requested = false;
+    void *table = NULL;
+
+    if (requested)
+        return;
+    requested = true;
+
+    compose_started = start_worker(&compose_thread, compose_worker, (void *)compose_locale, &table);
+    if (!compose_started)
+        set_compose_table(table);
+}
+
+/*
+ * Waits for the compose table to be loaded (if that is in progress) and
+ * installs it.
+ *
+ */
+static void finish_compose_loading(void) {
+    void *table = NULL;
+
+    if (!compose_started)
+        return;
+
+    join_worker("join_compose_table", compose_thread, true, &table);
+    compose_started = false;
+    set_compose_table(table);
+}
+
+static void compose_ready_cb(EV_P_ ev_async *w, int revents) {
+    finish_compose_loading();
 }
-#endif
 
 /*
  * This callback is only a dummy, see xcb_prepare_cb and xcb_check_cb.
@@ -882,6 +1568,32 @@ static void maybe_close_sleep_lock_fd(void) {
     }
 }
 
+static const char *event_trace_name(int type) {
+    switch (type) {
+        case XCB_KEY_PRESS:
+            return "KeyPress";
+        case XCB_VISIBILITY_NOTIFY:
+            return "VisibilityNotify";
+        case XCB_MAP_NOTIFY:
+            return "MapNotify";
+        case XCB_FOCUS_IN:
+        case XCB_FOCUS_OUT:
+            return "Focus";
+        case XCB_ENTER_NOTIFY:
+        case XCB_LEAVE_NOTIFY:
+            return "Crossing";
+        case XCB_CONFIGURE_NOTIFY:
+            return "ConfigureNotify";
+        case XCB_GE_GENERIC:
+            return "GenericEvent";
+    }
+    if (type == xkb_base_event)
+        return "XkbEvent";
+    if (randr_base > -1 && type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY)
+        return "RRScreenChangeNotify";
+    return "OtherEvent";
+}
+
 /*
  * Instead of polling the X connection socket we leave this to
  * xcb_poll_for_event() which knows better than we can ever know.
@@ -889,6 +1601,7 @@ static void maybe_close_sleep_lock_fd(void) {
  */
 static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
     xcb_generic_event_t *event;
+    int keys = 0;
 
     if (xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "X11 connection broke, did your server terminate?");
@@ -906,32 +1619,54 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
         /* Strip off the highest bit (set if the event is generated) */
         int type = (event->response_type & 0x7F);
 
+        /* With --trace-startup, round trips are counted per event type. */
+        const char *context = trace_context(event_trace_name(type));
+
         switch (type) {
             case XCB_KEY_PRESS:
-                handle_key_press((xcb_key_press_event_t *)event);
+                /* Key presses are only reported once we grabbed the keyboard,
+                 * possibly before the pointer (see keyboard_locked). */
+                if (locked || keyboard_locked) {
+                    if (keys++ == 0)
+                        begin_key_batch();
+                    /* The key might have been pressed after a keymap change
+                     * which we received in this same batch of events. */
+                    flush_keymap_changes();
+                    start_counting_allocations();
+                    handle_key_press((xcb_key_press_event_t *)event);
+                    check_key_allocations("key press", stop_counting_allocations());
+                }
                 break;
 
             case XCB_VISIBILITY_NOTIFY:
                 handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
+                grab_hint();
                 break;
 
             case XCB_MAP_NOTIFY:
-                maybe_close_sleep_lock_fd();
-                if (!dont_fork) {
-                    /* After the first MapNotify, we never fork again. We don’t
-                     * expect to get another MapNotify, but better be sure… */
-                    dont_fork = true;
+                trace_mark("map_notify");
+                window_mapped = true;
+                grab_hint();
+                maybe_detach();
+                break;
 
-                    /* In the parent process, we exit */
-                    if (fork() != 0)
-                        exit(0);
+            case XCB_FOCUS_IN:
+            case XCB_FOCUS_OUT:
+            case XCB_ENTER_NOTIFY:
+            case XCB_LEAVE_NOTIFY:
+                grab_hint();
+                break;
 
-                    ev_loop_fork(EV_DEFAULT);
-                }
+            case XCB_CONFIGURE_NOTIFY: {
+                xcb_configure_notify_event_t *configure = (xcb_configure_notify_event_t *)event;
+                if (configure->window == screen->root)
+                    handle_screen_resize(configure->width, configure->height, false);
                 break;
+            }
 
-            case XCB_CONFIGURE_NOTIFY:
-                handle_screen_resize();
+            case XCB_GE_GENERIC:
+                /* Frames presented with --present. */
+                present_handle_event(event);
                 break;
 
             default:
@@ -940,13 +1675,27 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
                 }
                 if (randr_base > -1 &&
                     type == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
-                    randr_query(screen->root);
-                    handle_screen_resize();
+                    xcb_randr_screen_change_notify_event_t *change = (xcb_randr_screen_change_notify_event_t *)event;
+                    /* The size is the unrotated one, unlike in the root
+                     * window's ConfigureNotify. */
+                    if (change->rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270))
+                        handle_screen_resize(change->height, change->width, true);
+                    else
+                        handle_screen_resize(change->width, change->height, true);
                 }
         }
 
+        trace_context(context);
         free(event);
     }
+
+    if (keys > 0)
+        end_key_batch(keys);
+
+    flush_keymap_changes();
+
+    /* Reading the events also read any replies to our grab requests. */
+    poll_grab();
 }
 
 /*
@@ -1004,15 +1753,661 @@ static void raise_loop(xcb_window_t window) {
     }
 }
 
+/*
+ * Covers the screen: remembers which window had the focus and maps the lock
+ * window (which already has the rendered background in place).
+ *
+ */
+static void show_lock_window(void) {
+    stolen_focus = find_focused_window(conn, screen->root);
+
+    int trace = trace_begin("map_fullscreen_window");
+    map_fullscreen_window(conn, win);
+    trace_end(trace);
+}
+
+/*
+ * Gives the screen back: releases the grabs, removes the lock window and
+ * restores the focus. The window is gone as soon as the X server processed the
+ * first flush, the rest is not visible to the user.
+ *
+ */
+static void release_screen(void) {
+    xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+    if (daemon_mode)
+        xcb_unmap_window(conn, win);
+    else
+        xcb_destroy_window(conn, win);
+    xcb_flush(conn);
+    locked = false;
+    keyboard_locked = false;
+
+    /* The raise_loop() exits once it sees the window unmapped, but it might
+     * not have selected the events yet (when unlocking right after locking).
+     * Its exit is handled by child_exited(). */
+    if (raise_pid > 0) {
+        kill(raise_pid, SIGTERM);
+        raise_pid = 0;
+    }
+
+    if (stolen_focus != XCB_NONE) {
+        DEBUG("restoring focus to X11 window 0x%08x\n", stolen_focus);
+        set_focused_window(conn, screen->root, stolen_focus);
+        stolen_focus = XCB_NONE;
+    }
+    trace_round_trip("xcb_aux_sync");
+    xcb_aux_sync(conn);
+}
+
+/*
+ * Resets everything which the previous lock left behind (input, timers,
+ * failed attempts) and pre-renders the idle screen, so that the next
+ * daemon_lock() can map the window right away.
+ *
+ */
+static void rearm(void) {
+    locked = false;
+
+    STOP_TIMER(clear_auth_wrong_timeout);
+    STOP_TIMER(clear_indicator_timeout);
+    STOP_TIMER(discard_passwd_timeout);
+    STOP_TIMER(redraw_timeout_timer);
+    clear_input();
+    clear_queued_password();
+    failed_attempts = 0;
+    modifier_string[0] = '\0';
+
+    auth_state = STATE_AUTH_IDLE;
+    unlock_state = STATE_STARTED;
+    redraw_screen();
+}
+
+/*
+ * Grabbing pointer and keyboard happens asynchronously on the event loop (see
+ * start_locking()): both grab requests are sent together and their replies
+ * are collected in xcb_check_cb. If another client holds a grab, we retry
+ * with an exponential backoff, or as soon as a focus or crossing event
+ * suggests that the other grab was released.
+ *
+ */
+/* After this long, we set the focus to our window, possibly closing context
+ * menus which would otherwise prevent us from grabbing. */
+#define GRAB_TAKE_FOCUS_AFTER TSTAMP_N_SECS(0.1)
+#define GRAB_TIMEOUT TSTAMP_N_SECS(3)
+#define GRAB_MIN_BACKOFF TSTAMP_N_SECS(0.001)
+#define GRAB_MAX_BACKOFF TSTAMP_N_SECS(0.05)
+
+static struct {
+    bool active;
+    bool have_pointer;
+    bool have_keyboard;
+    /* Whether the respective request is still in flight. */
+    bool pointer_pending;
+    bool keyboard_pending;
+    xcb_grab_pointer_cookie_t pointer_cookie;
+    xcb_grab_keyboard_cookie_t keyboard_cookie;
+    int pointer_trace;
+    int keyboard_trace;
+    int trace;
+
+    int attempts;
+    bool focus_taken;
+    /* Set when an event suggests retrying while requests are in flight. */
+    bool retry_now;
+    ev_tstamp started;
+    ev_tstamp backoff;
+    struct ev_timer retry_timer;
+} grab;
+
+/* Whether we are in the process of locking (grabbing, or displaying that
+ * grabbing failed). */
+static bool locking = false;
+static struct ev_timer lock_failed_timer;
+/* Daemon socket clients waiting for the result of the current lock. */
+#define MAX_LOCK_CLIENTS 8
+static int lock_clients[MAX_LOCK_CLIENTS];
+static int num_lock_clients = 0;
+
+static void send_grab_requests(void) {
+    grab.attempts++;
+
+    if (!grab.have_pointer) {
+        grab.pointer_trace = trace_begin("grab_pointer");
+        grab.pointer_cookie = xcb_grab_pointer(
+            conn,
+            false,               /* get all pointer events specified by the following mask */
+            screen->root,        /* grab the root window */
+            XCB_NONE,            /* which events to let through */
+            XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
+            XCB_GRAB_MODE_ASYNC, /* keyboard mode */
+            XCB_NONE,            /* confine_to = in which window should the cursor stay */
+            cursor,              /* we change the cursor to whatever the user wanted */
+            XCB_CURRENT_TIME);
+        grab.pointer_pending = true;
+    }
+
+    if (!grab.have_keyboard) {
+        grab.keyboard_trace = trace_begin("grab_keyboard");
+        grab.keyboard_cookie = xcb_grab_keyboard(
+            conn,
+            true,         /* report events */
+            screen->root, /* grab the root window */
+            XCB_CURRENT_TIME,
+            XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
+            XCB_GRAB_MODE_ASYNC);
+        grab.keyboard_pending = true;
+    }
+
+    xcb_flush(conn);
+}
+
+static void grab_retry_cb(EV_P_ ev_timer *w, int revents) {
+    send_grab_requests();
+}
+
+/*
+ * Replies to all daemon socket clients waiting for the current lock.
+ *
+ */
+static void reply_lock_clients(bool success) {
+    const char *reply = (success ? "locked\n" : "failed\n");
+
+    for (int c = 0; c < num_lock_clients; c++) {
+        if (write(lock_clients[c], reply, strlen(reply)) == -1)
+            DEBUG("Could not reply to lock request: %s\n", strerror(errno));
+        close(lock_clients[c]);
+    }
+    num_lock_clients = 0;
+}
+
+/*
+ * Called one second after grabbing failed (so that the user could see the
+ * "lock failed" message).
+ *
+ */
+static void lock_failed_cb(EV_P_ ev_timer *w, int revents) {
+    if (!daemon_mode)
+        errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+
+    fprintf(stderr, "Cannot grab pointer/keyboard\n");
+    locking = false;
+    release_screen();
+    rearm();
+    reply_lock_clients(false);
+}
+
+/*
+ * Once the window is mapped and pointer and keyboard are grabbed, the screen
+ * is locked: we close the sleep lock fd and fork (unless -n was given), so
+ * that our parent exiting signals that the screen is locked.
+ *
+ */
+static void maybe_detach(void) {
+    static bool detached = false;
+
+    if (!window_mapped || !locked || detached)
+        return;
+    detached = true;
+
+    maybe_close_sleep_lock_fd();
+    if (!dont_fork) {
+        /* After the first MapNotify, we never fork again. */
+        dont_fork = true;
+
+        /* In the parent process, we exit. The child writes the trace. */
+        pid_t pid = fork();
+        if (pid != 0) {
+            if (pid > 0)
+                trace_hand_over(pid);
+            exit(0);
+        }
+        trace_hand_over(getpid());
+
+        ev_loop_fork(EV_DEFAULT);
+    }
+
+    /* Threads do not survive the fork() above, so only start loading the
+     * compose table now. */
+    start_compose_loading();
+}
+
+static void grab_finished(bool success) {
+    grab.active = false;
+    ev_timer_stop(main_loop, &grab.retry_timer);
+    trace_end(grab.trace);
+
+    /* We only needed the focus and crossing events while grabbing. */
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+
+    if (!success) {
+        DEBUG("grabbing failed after %d attempts\n", grab.attempts);
+        /* Whatever was typed is dropped with the failed lock. */
+        keyboard_locked = false;
+        auth_state = STATE_I3LOCK_LOCK_FAILED;
+        redraw_screen();
+        ev_timer_set(&lock_failed_timer, TSTAMP_N_SECS(1), 0.);
+        ev_timer_start(main_loop, &lock_failed_timer);
+        return;
+    }
+
+    DEBUG("grabbed pointer and keyboard after %d attempts in %.1f ms\n",
+          grab.attempts, (ev_time() - grab.started) * 1000);
+    trace_mark("grab_success");
+
+    /* In daemon mode, the compose worker of the first lock might still be
+     * running, see input_done(). */
+    finish_compose_loading();
+
+    pid_t pid = fork();
+    /* The pid == -1 case is intentionally ignored here:
+     * While the child process is useful for preventing other windows from
+     * popping up while i3lock blocks, it is not critical. */
+    if (pid == 0) {
+        /* Child */
+        close(xcb_get_file_descriptor(conn));
+        maybe_close_sleep_lock_fd();
+        raise_loop(win);
+        exit(EXIT_SUCCESS);
+    }
+    if (pid > 0)
+        raise_pid = pid;
+
+    /* Explicitly call the screen redraw in case "locking…" message was displayed */
+    auth_state = STATE_AUTH_IDLE;
+    redraw_screen();
+
+    /* Only with tracing, wait until the X server processed the frame, so that
+     * the report contains the time at which the screen was completely drawn. */
+    if (trace_enabled()) {
+        redraw_screen_now();
+        trace_round_trip("xcb_aux_sync");
+        xcb_aux_sync(conn);
+        trace_mark("first_frame");
+    }
+
+    locking = false;
+    locked = true;
+    keyboard_locked = false;
+    reply_lock_clients(true);
+    maybe_detach();
+
+    /* Enter was pressed before the pointer grab succeeded. */
+    verify_queued_password();
+}
+
+/*
+ * Collects the replies to our grab requests and decides how to go on. Called
+ * from xcb_check_cb, i.e. after reading from the X11 connection.
+ *
+ */
+static void poll_grab(void) {
+    void *reply;
+    xcb_generic_error_t *error;
+
+    if (!grab.active)
+        return;
+
+    if (grab.pointer_pending &&
+        xcb_poll_for_reply(conn, grab.pointer_cookie.sequence, &reply, &error)) {
+        xcb_grab_pointer_reply_t *preply = reply;
+        trace_end(grab.pointer_trace);
+        grab.pointer_pending = false;
+        grab.have_pointer = (preply != NULL && preply->status == XCB_GRAB_STATUS_SUCCESS);
+        free(reply);
+        free(error);
+    }
+
+    if (grab.keyboard_pending &&
+        xcb_poll_for_reply(conn, grab.keyboard_cookie.sequence, &reply, &error)) {
+        xcb_grab_keyboard_reply_t *kreply = reply;
+        trace_end(grab.keyboard_trace);
+        grab.keyboard_pending = false;
+        grab.have_keyboard = (kreply != NULL && kreply->status == XCB_GRAB_STATUS_SUCCESS);
+        free(reply);
+        free(error);
+
+        if (grab.have_keyboard) {
+            /* Load the keymap again to sync the current modifier state. Since
+             * we first loaded the keymap, there might have been changes, but
+             * starting from now, we should get all key presses/releases due
+             * to having grabbed the keyboard. Unless the keymap itself
+             * changed, this only fetches the state. */
+            (void)load_keymap(false);
+            keyboard_locked = true;
+        }
+    }
+
+    if (grab.pointer_pending || grab.keyboard_pending)
+        return;
+
+    if (grab.have_pointer && grab.have_keyboard) {
+        grab_finished(true);
+        return;
+    }
+
+    ev_tstamp elapsed = ev_time() - grab.started;
+    if (elapsed >= GRAB_TIMEOUT) {
+        grab_finished(false);
+        return;
+    }
+
+    if (!grab.focus_taken && elapsed >= GRAB_TAKE_FOCUS_AFTER) {
+        grab.focus_taken = true;
+        DEBUG("stole focus from X11 window 0x%08x\n", stolen_focus);
+
+        /* Set the focus to i3lock, possibly closing context menus which would
+         * otherwise prevent us from grabbing keyboard/pointer.
+         *
+         * We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
+         * works for managed windows, but i3lock uses an unmanaged window
+         * (override_redirect=1). */
+        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
+
+        /* Display the "locking…" message, grabbing takes a while. */
+        redraw_screen();
+        grab.retry_now = true;
+    }
+
+    if (grab.retry_now) {
+        grab.retry_now = false;
+        grab.backoff = GRAB_MIN_BACKOFF;
+        send_grab_requests();
+        return;
+    }
+
+    ev_timer_set(&grab.retry_timer, grab.backoff, 0.);
+    ev_timer_start(main_loop, &grab.retry_timer);
+    grab.backoff *= 2;
+    if (grab.backoff > GRAB_MAX_BACKOFF)
+        grab.backoff = GRAB_MAX_BACKOFF;
+}
+
+/*
+ * Called for events which might mean that the client whose grab prevented
+ * ours released it (focus changes, pointer crossings, visibility changes):
+ * retries right away instead of waiting for the backoff.
+ *
+ */
+static void grab_hint(void) {
+    if (!grab.active)
+        return;
+
+    if (grab.pointer_pending || grab.keyboard_pending) {
+        grab.retry_now = true;
+        return;
+    }
+
+    if (ev_is_active(&grab.retry_timer)) {
+        ev_timer_stop(main_loop, &grab.retry_timer);
+        grab.backoff = GRAB_MIN_BACKOFF;
+        send_grab_requests();
+    }
+}
+
+/*
+ * Starts grabbing pointer and keyboard. Once that succeeded, the raise_loop()
+ * child is started and the screen is locked, see grab_finished().
+ *
+ */
+static void start_locking(void) {
+    locking = true;
+
+    /* Display the "locking…" message while trying to grab the pointer/keyboard. */
+    auth_state = STATE_AUTH_LOCK;
+
+    memset(&grab, 0, sizeof(grab));
+    grab.active = true;
+    grab.started = ev_time();
+    grab.backoff = GRAB_MIN_BACKOFF;
+    grab.trace = trace_begin("grab");
+    ev_timer_init(&grab.retry_timer, grab_retry_cb, 0., 0.);
+    ev_timer_init(&lock_failed_timer, lock_failed_cb, 0., 0.);
+
+    /* Focus changes and pointer crossings with mode Ungrab tell us when
+     * another client released its grab. */
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){
+                                     XCB_EVENT_MASK_STRUCTURE_NOTIFY |
+                                     XCB_EVENT_MASK_FOCUS_CHANGE |
+                                     XCB_EVENT_MASK_ENTER_WINDOW |
+                                     XCB_EVENT_MASK_LEAVE_WINDOW});
+
+    send_grab_requests();
+}
+
+/*
+ * Called after a successful authentication. We give the screen back right
+ * away, then (outside of daemon mode) end the event loop and thus i3lock. In
+ * daemon mode, we wait for the next trigger.
+ *
+ */
+static void unlock_screen(void) {
+    release_screen();
+    DEBUG("unlocked %.1f ms after enter was pressed (authentication took %.1f ms)\n",
+          (ev_time() - auth_requested) * 1000, (auth_finished - auth_requested) * 1000);
+
+    if (!daemon_mode) {
+        ev_break(EV_DEFAULT, EVBREAK_ALL);
+        return;
+    }
+
+    rearm();
+}
+
+/*
+ * Locks the screen in daemon mode. The given daemon socket client (or -1) is
+ * told about the result once grabbing succeeded or failed.
+ *
+ */
+static void daemon_lock(int client) {
+    if (client != -1) {
+        if (num_lock_clients == MAX_LOCK_CLIENTS) {
+            close(client);
+        } else {
+            lock_clients[num_lock_clients++] = client;
+        }
+    }
+
+    if (locked) {
+        reply_lock_clients(true);
+        return;
+    }
+    if (locking)
+        return;
+
+    DEBUG("lock requested\n");
+    show_lock_window();
+    start_locking();
+}
+
+/*
+ * Returns the path of the socket on which the daemon listens for lock
+ * requests: $XDG_RUNTIME_DIR/i3lock-$DISPLAY.sock (or a uid-specific file in
+ * /tmp if $XDG_RUNTIME_DIR is not set).
+ *
+ */
+static char *get_daemon_socket_path(void) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    const char *display = getenv("DISPLAY");
+    char *name, *path;
+    int res;
+
+    /* DISPLAY may contain slashes (e.g. launchd sockets on macOS). */
+    if ((name = strdup(display != NULL ? display : "")) == NULL)
+        err(EXIT_FAILURE, "strdup()");
+    for (char *c = name; *c != '\0'; c++)
+        if (*c == '/')
+            *c = '_';
+
+    if (dir != NULL && *dir != '\0')
+        res = asprintf(&path, "%s/i3lock-%s.sock", dir, name);
+    else
+        res = asprintf(&path, "/tmp/i3lock-%d-%s.sock", (int)getuid(), name);
+    if (res == -1)
+        err(EXIT_FAILURE, "asprintf()");
+
+    free(name);
+    return path;
+}
+
+/*
+ * Asks a running daemon to lock the screen and waits for its answer. Returns
+ * 1 if the screen is locked now, 0 if the daemon failed to lock it and -1 if
+ * no daemon answered.
+ *
+ */
+static int request_daemon_lock(void) {
+    struct sockaddr_un addr;
+    char *path = get_daemon_socket_path();
+    char reply[16];
+    ssize_t n;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "i3lock: daemon socket path %s is too long\n", path);
+        free(path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        warn("socket()");
+        free(path);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        warn("Could not connect to the daemon on %s", path);
+        close(fd);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    DEBUG("handing the lock request to the daemon\n");
+    while ((n = read(fd, reply, sizeof(reply) - 1)) == -1 && errno == EINTR)
+        ;
+    close(fd);
+    if (n <= 0) {
+        warnx("The daemon did not answer the lock request");
+        return -1;
+    }
+    reply[n] = '\0';
+    return (strcmp(reply, "locked\n") == 0 ? 1 : 0);
+}
+
+static void remove_daemon_socket(void) {
+    /* Forked children (see raise_loop()) must not remove the socket. */
+    if (getpid() == daemon_pid)
+        unlink(daemon_socket_path);
+}
+
+/*
+ * Creates the socket on which the daemon listens for lock requests. A stale
+ * socket (left behind by a daemon which was killed) is replaced, but if
+ * another daemon is still listening on it, we exit.
+ *
+ */
+static int listen_daemon_socket(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        errx(EXIT_FAILURE, "Socket path \"%s\" is too long", path);
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        err(EXIT_FAILURE, "socket()");
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        errx(EXIT_FAILURE, "Another i3lock daemon is already listening on %s", path);
+    close(fd);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        err(EXIT_FAILURE, "socket()");
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    /* Only the user running i3lock may request a lock. */
+    mode_t old_umask = umask(0077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        err(EXIT_FAILURE, "bind(%s)", path);
+    umask(old_umask);
+
+    if (listen(fd, 4) == -1)
+        err(EXIT_FAILURE, "listen()");
+
+    return fd;
+}
+
+/*
+ * A client connected to the daemon socket: lock the screen and tell the
+ * client whether that worked ("locked\n" or "failed\n") once the grab is in
+ * place, so that e.g. a suspend hook can wait for it.
+ *
+ */
+static void daemon_socket_cb(EV_P_ ev_io *w, int revents) {
+    int client = accept(w->fd, NULL, NULL);
+    if (client == -1)
+        return;
+    (void)fcntl(client, F_SETFD, FD_CLOEXEC);
+
+    daemon_lock(client);
+}
+
+static void daemon_signal_cb(EV_P_ ev_signal *w, int revents) {
+    if (w->signum == SIGUSR1) {
+        daemon_lock(-1);
+        return;
+    }
+
+    /* SIGTERM/SIGINT: give the screen back and exit. */
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/*
+ * Sets up the lock triggers of the daemon mode: SIGUSR1 and connections to
+ * the daemon socket.
+ *
+ */
+static void arm_daemon(void) {
+    static struct ev_io socket_watcher;
+    static struct ev_signal signal_watchers[3];
+    static const int signals[] = {SIGUSR1, SIGTERM, SIGINT};
+
+    /* The sleep lock fd (if any) belongs to whoever started the daemon, not
+     * to any of the locks we will perform. */
+    maybe_close_sleep_lock_fd();
+    unsetenv("XSS_SLEEP_LOCK_FD");
+
+    /* Clients might hang up before we reply. */
+    signal(SIGPIPE, SIG_IGN);
+
+    daemon_pid = getpid();
+    daemon_socket_path = get_daemon_socket_path();
+    int fd = listen_daemon_socket(daemon_socket_path);
+    atexit(remove_daemon_socket);
+    DEBUG("listening for lock requests on %s\n", daemon_socket_path);
+
+    ev_io_init(&socket_watcher, daemon_socket_cb, fd, EV_READ);
+    ev_io_start(main_loop, &socket_watcher);
+
+    for (size_t c = 0; c < sizeof(signals) / sizeof(signals[0]); c++) {
+        ev_signal_init(&signal_watchers[c], daemon_signal_cb, signals[c]);
+        ev_signal_start(main_loop, &signal_watchers[c]);
+    }
+}
+
 int main(int argc, char *argv[]) {
     struct passwd *pw;
-    char *username;
     char *image_path = NULL;
     char *image_raw_format = NULL;
-#ifndef __OpenBSD__
-    int ret;
-    struct pam_conv conv = {conv_callback, NULL};
-#endif
     int curs_choice = CURS_NONE;
     int o;
     int longoptind = 0;
@@ -1029,9 +2424,19 @@ int main(int argc, char *argv[]) {
         {"image", required_argument, NULL, 'i'},
         {"raw", required_argument, NULL, 0},
         {"tiling", no_argument, NULL, 't'},
+        {"center", no_argument, NULL, 0},
+        {"fill", no_argument, NULL, 0},
+        {"fit", no_argument, NULL, 0},
+        {"stretch", no_argument, NULL, 0},
         {"ignore-empty-password", no_argument, NULL, 'e'},
         {"inactivity-timeout", required_argument, NULL, 'I'},
         {"show-failed-attempts", no_argument, NULL, 'f'},
+        {"daemon", no_argument, NULL, 0},
+        {"auth-timeout", required_argument, NULL, 0},
+        {"auth-backend", required_argument, NULL, 0},
+        {"trace-startup", optional_argument, NULL, 0},
+        {"trace-format", required_argument, NULL, 0},
+        {"present", no_argument, NULL, 0},
         {NULL, no_argument, NULL, 0}};
 
     if ((pw = getpwuid(getuid())) == NULL)
@@ -1095,28 +2500,69 @@ int main(int argc, char *argv[]) {
                     debug_mode = true;
                 else if (strcmp(longopts[longoptind].name, "raw") == 0)
                     image_raw_format = strdup(optarg);
+                else if (strcmp(longopts[longoptind].name, "center") == 0)
+                    image_mode = IMAGE_MODE_CENTER;
+                else if (strcmp(longopts[longoptind].name, "fill") == 0)
+                    image_mode = IMAGE_MODE_FILL;
+                else if (strcmp(longopts[longoptind].name, "fit") == 0)
+                    image_mode = IMAGE_MODE_FIT;
+                else if (strcmp(longopts[longoptind].name, "stretch") == 0)
+                    image_mode = IMAGE_MODE_STRETCH;
+                else if (strcmp(longopts[longoptind].name, "daemon") == 0)
+                    daemon_mode = true;
+                else if (strcmp(longopts[longoptind].name, "auth-timeout") == 0) {
+                    char *endptr;
+                    long timeout = strtol(optarg, &endptr, 10);
+                    if (*optarg == '\0' || *endptr != '\0' || timeout < 0 || timeout > 3600)
+                        errx(EXIT_FAILURE, "i3lock: Invalid authentication timeout given. Expected seconds between 0 and 3600.");
+                    auth_timeout = timeout;
+                } else if (strcmp(longopts[longoptind].name, "present") == 0) {
+                    use_present = true;
+                } else if (strcmp(longopts[longoptind].name, "auth-backend") == 0) {
+                    if (!auth_set_backend(optarg))
+                        errx(EXIT_FAILURE, "i3lock: Invalid authentication backend \"%s\" given.", optarg);
+                }
+                else if (strcmp(longopts[longoptind].name, "trace-startup") == 0)
+                    trace_init(optarg);
+                else if (strcmp(longopts[longoptind].name, "trace-format") == 0) {
+                    if (strcmp(optarg, "json") == 0)
+                        trace_set_format(TRACE_FORMAT_JSON);
+                    else if (strcmp(optarg, "csv") == 0)
+                        trace_set_format(TRACE_FORMAT_CSV);
+                    else
+                        errx(EXIT_FAILURE, "i3lock: Invalid trace format given. Expected one of \"json\" or \"csv\".");
+                }
                 break;
             case 'f':
                 show_failed_attempts = true;
                 break;
             default:
                 errx(EXIT_FAILURE, "Syntax: i3lock [-v] [-n] [-b] [-d] [-c color] [-u] [-p win|default]"
-                                   " [-i image.png] [-t] [-e] [-I timeout] [-f]");
+                                   " [-i image.png] [-t] [--center|--fill|--fit|--stretch] [-e] [-I timeout] [-f]"
+                                   " [--daemon] [--auth-timeout seconds] [--auth-backend backend] [--present] [--trace-startup[=file]] [--trace-format=json|csv]");
         }
     }
 
+    /* The daemon stays in the foreground (it is meant to be started by the
+     * session or a service manager) and keeps its window across locks. */
+    if (daemon_mode)
+        dont_fork = true;
+
     /* We need (relatively) random numbers for highlighting a random part of
      * the unlock indicator upon keypresses. */
     srand(time(NULL));
 
-#ifndef __OpenBSD__
-    /* Initialize PAM */
-    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
-
-    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
-#endif
+    const char *locale = getenv("LC_ALL");
+    if (!locale || !*locale)
+        locale = getenv("LC_CTYPE");
+    if (!locale || !*locale)
+        locale = getenv("LANG");
+    if (!locale || !*locale) {
+        if (debug_mode)
+            fprintf(stderr, "Can't detect your locale, fallback to C\n");
+        locale = "C";
+    }
+    compose_locale = locale;
 
 /* Using mlock() as non-super-user seems only possible in Linux.
  * Users of other operating systems should use encrypted swap/no swap
@@ -1127,16 +2573,82 @@ int main(int argc, char *argv[]) {
     /* Lock the area where we store the password in memory, we don’t want it to
      * be swapped to disk. Since Linux 2.6.9, this does not require any
      * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. */
-    if (mlock(password, sizeof(password)) != 0)
+    if (mlock(password, sizeof(password)) != 0 ||
+        mlock(queued_password, sizeof(queued_password)) != 0)
         err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
 #endif
 
     /* Double checking that connection is good and operatable with xcb */
     int screennr;
+    int trace = trace_begin("xcb_connect");
     if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
         xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
+    trace_end(trace);
 
+    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+
+    /* Send everything we will need to know early on right away, so that all
+     * the replies arrive with the first round trip (which is taken by
+     * acquire_lock_selection()) instead of one by one. */
+    xcb_prefetch_extension_data(conn, &xcb_xkb_id);
+    xcb_prefetch_extension_data(conn, &xcb_randr_id);
+    xcb_prefetch_extension_data(conn, &xcb_shm_id);
+    if (use_present)
+        prefetch_present();
+    prefetch_atoms(conn);
+    prefetch_dpi();
+
+    /* Only one locker per display: when we are started more than once (e.g.
+     * by xss-lock and a hotkey at the same time), all but the first instance
+     * exit right away instead of stacking windows and grabs. */
+    trace = trace_begin("acquire_lock_selection");
+    lock_owner_t owner = acquire_lock_selection(conn, screen->root, screennr, daemon_mode);
+    if (owner != LOCK_ACQUIRED && daemon_mode)
+        errx(EXIT_FAILURE, "Another i3lock is already running on this display");
+    switch (owner) {
+        case LOCK_ACQUIRED:
+            break;
+        case LOCK_OWNER_LOCKER:
+            DEBUG("Another i3lock is already locking this display, exiting\n");
+            exit(EXIT_SUCCESS);
+        case LOCK_OWNER_DAEMON:
+            /* A daemon which is not locked yet still owns the selection. */
+            switch (request_daemon_lock()) {
+                case 1:
+                    DEBUG("The daemon locked the screen, exiting\n");
+                    exit(EXIT_SUCCESS);
+                case 0:
+                    errx(EXIT_FAILURE, "The i3lock daemon could not lock the screen");
+            }
+            /* Better lock twice than not at all. */
+            warnx("No daemon answered, locking the screen ourselves");
+            break;
+        case LOCK_OWNER_UNKNOWN:
+            warnx("The lock selection of this display is owned by an unknown client, "
+                  "locking the screen anyway");
+            break;
+    }
+    trace_end(trace);
+
+    /* Startup is pipelined: PAM initialization and image decoding do not
+     * depend on the X11 connection, so they run on worker threads while we
+     * set up XKB and load the keymap. Both workers are joined before the
+     * first fork(). They are only started once we know that we are the only
+     * instance, so that a duplicate launch exits without threads running
+     * and without decoding the image. */
+    pthread_t auth_thread;
+    void *auth_ready = NULL;
+    bool auth_started = start_worker(&auth_thread, start_auth, username, &auth_ready);
+
+    pthread_t image_thread;
+    struct image_job image_job = {image_path, image_raw_format, NULL, NULL};
+    bool image_started = false;
+    if (image_path != NULL)
+        image_started = start_worker(&image_thread, load_image, &image_job, NULL);
+
+    trace = trace_begin("xkb_x11_setup_xkb_extension");
+    trace_round_trip("xkb_x11_setup_xkb_extension");
     if (xkb_x11_setup_xkb_extension(conn,
                                     XKB_X11_MIN_MAJOR_XKB_VERSION,
                                     XKB_X11_MIN_MINOR_XKB_VERSION,
@@ -1146,6 +2658,9 @@ int main(int argc, char *argv[]) {
                                     &xkb_base_event,
                                     &xkb_base_error) != 1)
         errx(EXIT_FAILURE, "Could not setup XKB extension.");
+    trace_round_trip("xkb_x11_get_core_keyboard_device_id");
+    keyboard_device_id = xkb_x11_get_core_keyboard_device_id(conn);
+    trace_end(trace);
 
     static const xcb_xkb_map_part_t required_map_parts =
         (XCB_XKB_MAP_PART_KEY_TYPES |
@@ -1163,7 +2678,7 @@ int main(int argc, char *argv[]) {
 
     xcb_xkb_select_events(
         conn,
-        xkb_x11_get_core_keyboard_device_id(conn),
+        keyboard_device_id,
         required_events,
         0,
         required_events,
@@ -1172,28 +2687,17 @@ int main(int argc, char *argv[]) {
         0);
 
     /* When we cannot initially load the keymap, we better exit */
-    if (!load_keymap())
+    if (!load_keymap(false))
         errx(EXIT_FAILURE, "Could not load keymap");
 
-    const char *locale = getenv("LC_ALL");
-    if (!locale || !*locale)
-        locale = getenv("LC_CTYPE");
-    if (!locale || !*locale)
-        locale = getenv("LANG");
-    if (!locale || !*locale) {
-        if (debug_mode)
-            fprintf(stderr, "Can't detect your locale, fallback to C\n");
-        locale = "C";
-    }
-
-    load_compose_table(locale);
-
-    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
-
+    trace = trace_begin("init_dpi");
     init_dpi();
+    trace_end(trace);
 
+    trace = trace_begin("randr_query");
     randr_init(&randr_base, screen->root);
     randr_query(screen->root);
+    trace_end(trace);
 
     last_resolution[0] = screen->width_in_pixels;
     last_resolution[1] = screen->height_in_pixels;
@@ -1201,81 +2705,60 @@ int main(int argc, char *argv[]) {
     xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
                                  (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
 
-    if (image_raw_format != NULL && image_path != NULL) {
-        /* Read image. 'read_raw_image' returns NULL on error,
-         * so we don't have to handle errors here. */
-        img = read_raw_image(image_path, image_raw_format);
-    } else if (verify_png_image(image_path)) {
-        /* Create a pixmap to render on, fill it with the background color */
-        img = cairo_image_surface_create_from_png(image_path);
-        /* In case loading failed, we just pretend no -i was specified. */
-        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not load image \"%s\": %s\n",
-                    image_path, cairo_status_to_string(cairo_surface_status(img)));
-            img = NULL;
-        }
-    }
-
+    /* The image is the first thing we need from the workers. */
+    join_worker("join_image", image_thread, image_started, NULL);
+    img = image_job.img;
+    img_shm = image_job.shm;
     free(image_path);
     free(image_raw_format);
 
-    /* Pixmap on which the image is rendered to (if any) */
+    /* Pixmap on which the image is rendered to (if any). It is owned by the
+     * unlock indicator, which keeps it around for subsequent redraws. */
+    trace = trace_begin("draw_image");
     xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-
-    xcb_window_t stolen_focus = find_focused_window(conn, screen->root);
+    trace_end(trace);
 
     /* Open the fullscreen window, already with the correct pixmap in place */
+    trace = trace_begin("open_fullscreen_window");
     win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    xcb_free_pixmap(conn, bg_pixmap);
-
-    cursor = create_cursor(conn, screen, win, curs_choice);
-
-    /* Display the "locking…" message while trying to grab the pointer/keyboard. */
-    auth_state = STATE_AUTH_LOCK;
-    if (!grab_pointer_and_keyboard(conn, screen, cursor, 1000)) {
-        DEBUG("stole focus from X11 window 0x%08x\n", stolen_focus);
+    trace_end(trace);
 
-        /* Set the focus to i3lock, possibly closing context menus which would
-         * otherwise prevent us from grabbing keyboard/pointer.
-         *
-         * We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
-         * works for managed windows, but i3lock uses an unmanaged window
-         * (override_redirect=1). */
-        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
-        if (!grab_pointer_and_keyboard(conn, screen, cursor, 9000)) {
-            auth_state = STATE_I3LOCK_LOCK_FAILED;
-            redraw_screen();
-            sleep(1);
-            errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
-        }
+    if (use_present) {
+        trace = trace_begin("present_init");
+        if (!present_init(win))
+            fprintf(stderr, "i3lock: Present is not available, updating the unlock indicator without vblank synchronization.\n");
+        trace_end(trace);
     }
 
-    pid_t pid = fork();
-    /* The pid == -1 case is intentionally ignored here:
-     * While the child process is useful for preventing other windows from
-     * popping up while i3lock blocks, it is not critical. */
-    if (pid == 0) {
-        /* Child */
-        close(xcb_get_file_descriptor(conn));
-        maybe_close_sleep_lock_fd();
-        raise_loop(win);
-        exit(EXIT_SUCCESS);
-    }
-
-    /* Load the keymap again to sync the current modifier state. Since we first
-     * loaded the keymap, there might have been changes, but starting from now,
-     * we should get all key presses/releases due to having grabbed the
-     * keyboard. */
-    (void)load_keymap();
+    cursor = create_cursor(conn, screen, win, curs_choice);
 
     /* Initialize the libev event loop. */
     main_loop = EV_DEFAULT;
     if (main_loop == NULL)
         errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?");
 
-    /* Explicitly call the screen redraw in case "locking…" message was displayed */
-    auth_state = STATE_AUTH_IDLE;
-    redraw_screen();
+    init_redraw_scheduler();
+
+    /* pid 0 matches any child. */
+    ev_child_init(&child_watcher, child_exited, 0, 0);
+    ev_child_start(main_loop, &child_watcher);
+
+    ev_async_init(&compose_ready, compose_ready_cb);
+    ev_async_start(main_loop, &compose_ready);
+
+    if (!daemon_mode)
+        show_lock_window();
+
+    /* The auth worker needs to be done before we fork(), since threads do not
+     * survive it. */
+    join_worker("join_auth", auth_thread, auth_started, &auth_ready);
+    if (auth_ready == NULL)
+        errx(EXIT_FAILURE, "Could not initialize the %s authentication backend", auth_backend()->name);
+
+    if (daemon_mode)
+        arm_daemon();
+    else
+        start_locking();
 
     struct ev_io *xcb_watcher = calloc(sizeof(struct ev_io), 1);
     struct ev_check *xcb_check = calloc(sizeof(struct ev_check), 1);
@@ -1296,16 +2779,8 @@ int main(int argc, char *argv[]) {
     ev_invoke(main_loop, xcb_check, 0);
     ev_loop(main_loop, 0);
 
-    if (stolen_focus == XCB_NONE) {
-        return 0;
-    }
-
-    DEBUG("restoring focus to X11 window 0x%08x\n", stolen_focus);
-    xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
-    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
-    xcb_destroy_window(conn, win);
-    set_focused_window(conn, screen->root, stolen_focus);
-    xcb_aux_sync(conn);
+    if (locked)
+        release_screen();
 
     return 0;
 }
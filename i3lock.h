@@ -1,6 +1,8 @@
 #ifndef _I3LOCK_H
 #define _I3LOCK_H
 
+#include <stdbool.h>
+
 /* This macro will only print debug output when started with --debug.
  * This is important because xautolock (for example) closes stdout/stderr by
  * default, so just printing something to stdout will lead to the data ending
@@ -11,4 +13,11 @@
             printf("[i3lock-debug] " fmt, ##__VA_ARGS__); \
     } while (0)
 
+/* Allocation accounting for the key press path, which only counts with
+ * bench/count-alloc.so preloaded (see check_key_allocations()). */
+void start_counting_allocations(void);
+unsigned long stop_counting_allocations(void);
+bool counting_allocations(void);
+void check_key_allocations(const char *what, unsigned long allocations);
+
 #endif
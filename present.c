@@ -0,0 +1,184 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <xcb/xcb.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "present.h"
+#include "unlock_indicator.h"
+#include "trace.h"
+
+extern bool debug_mode;
+
+#ifdef HAVE_XCB_PRESENT
+
+#include <xcb/xfixes.h>
+#include <xcb/present.h>
+
+/* A frame which is not reported as presented after this many seconds (e.g.
+ * because the window is not visible) is not waited for any longer. */
+#define PRESENT_TIMEOUT 0.1
+
+static bool active = false;
+static xcb_window_t present_window;
+static uint8_t present_opcode;
+/* The update region of each frame, i.e. the areas of the indicator. */
+static xcb_xfixes_region_t update_region;
+
+static uint32_t last_serial = 0;
+static bool frame_pending = false;
+static ev_tstamp frame_sent;
+
+void prefetch_present(void) {
+    xcb_prefetch_extension_data(conn, &xcb_present_id);
+    xcb_prefetch_extension_data(conn, &xcb_xfixes_id);
+}
+
+bool present_init(xcb_window_t window) {
+    const xcb_query_extension_reply_t *present_ext = xcb_get_extension_data(conn, &xcb_present_id);
+    const xcb_query_extension_reply_t *xfixes_ext = xcb_get_extension_data(conn, &xcb_xfixes_id);
+    /* The extension data is NULL once the connection failed. */
+    if (present_ext == NULL || !present_ext->present ||
+        xfixes_ext == NULL || !xfixes_ext->present) {
+        DEBUG("Present or XFixes is not present, not using Present.\n");
+        return false;
+    }
+
+    /* Both extensions need their version to be negotiated before use. Send
+     * both requests before waiting for either reply. */
+    xcb_present_query_version_cookie_t present_cookie =
+        xcb_present_query_version(conn, XCB_PRESENT_MAJOR_VERSION, XCB_PRESENT_MINOR_VERSION);
+    xcb_xfixes_query_version_cookie_t xfixes_cookie =
+        xcb_xfixes_query_version(conn, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+
+    xcb_generic_error_t *err = NULL;
+    trace_round_trip("PresentQueryVersion");
+    xcb_present_query_version_reply_t *present_version =
+        xcb_present_query_version_reply(conn, present_cookie, &err);
+    free(err);
+    err = NULL;
+    xcb_xfixes_query_version_reply_t *xfixes_version =
+        xcb_xfixes_query_version_reply(conn, xfixes_cookie, &err);
+    free(err);
+
+    if (present_version == NULL || xfixes_version == NULL) {
+        DEBUG("Could not query the Present/XFixes version, not using Present.\n");
+        free(present_version);
+        free(xfixes_version);
+        return false;
+    }
+    DEBUG("Present %d.%d, XFixes %d.%d\n",
+          present_version->major_version, present_version->minor_version,
+          xfixes_version->major_version, xfixes_version->minor_version);
+    free(present_version);
+    free(xfixes_version);
+
+    present_window = window;
+    present_opcode = present_ext->major_opcode;
+
+    update_region = xcb_generate_id(conn);
+    xcb_xfixes_create_region(conn, update_region, 0, NULL);
+
+    xcb_present_select_input(conn, xcb_generate_id(conn), window,
+                             XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+    xcb_flush(conn);
+
+    active = true;
+    return true;
+}
+
+bool present_active(void) {
+    return active;
+}
+
+uint32_t present_frame(xcb_pixmap_t pixmap, const xcb_rectangle_t *rects, int n) {
+    xcb_xfixes_set_region(conn, update_region, n, rects);
+
+    /* The pixmap stays the window background and is drawn into again for the
+     * next frame, so it must be copied instead of flipped. target_msc = 0
+     * with divisor = 0 means the next vblank. */
+    xcb_present_pixmap(conn, present_window, pixmap, ++last_serial,
+                       XCB_NONE /* valid */, update_region,
+                       0, 0, XCB_NONE /* target_crtc */,
+                       XCB_NONE /* wait_fence */, XCB_NONE /* idle_fence */,
+                       XCB_PRESENT_OPTION_COPY, 0, 0, 0, 0, NULL);
+
+    frame_pending = true;
+    frame_sent = ev_time();
+    return last_serial;
+}
+
+double present_pending(void) {
+    if (!frame_pending)
+        return 0;
+    double wait = frame_sent + PRESENT_TIMEOUT - ev_time();
+    if (wait > 0)
+        return wait;
+    DEBUG("frame %" PRIu32 " was not presented in time, not waiting any longer\n", last_serial);
+    frame_pending = false;
+    return 0;
+}
+
+bool present_handle_event(xcb_generic_event_t *event) {
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)event;
+    if (!active || ge->extension != present_opcode ||
+        ge->event_type != XCB_PRESENT_COMPLETE_NOTIFY)
+        return false;
+
+    xcb_present_complete_notify_event_t *complete = (xcb_present_complete_notify_event_t *)event;
+    if (complete->kind != XCB_PRESENT_COMPLETE_KIND_PIXMAP)
+        return true;
+
+    DEBUG("frame %" PRIu32 " presented at msc %" PRIu64 ", ust %" PRIu64 "%s\n",
+          complete->serial, complete->msc, complete->ust,
+          (complete->mode == XCB_PRESENT_COMPLETE_MODE_SKIP ? " (skipped)" : ""));
+    /* A skipped frame was never scanned out: its ust is no photon time, and
+     * the next frame keeps waiting (at most until PRESENT_TIMEOUT). */
+    if (complete->mode == XCB_PRESENT_COMPLETE_MODE_SKIP)
+        return true;
+    if (complete->serial == last_serial)
+        frame_pending = false;
+    frame_presented(complete->serial, complete->ust, complete->msc);
+    return true;
+}
+
+#else
+
+void prefetch_present(void) {
+}
+
+bool present_init(xcb_window_t window) {
+    DEBUG("i3lock was built without Present support.\n");
+    return false;
+}
+
+bool present_active(void) {
+    return false;
+}
+
+uint32_t present_frame(xcb_pixmap_t pixmap, const xcb_rectangle_t *rects, int n) {
+    return 0;
+}
+
+double present_pending(void) {
+    return 0;
+}
+
+bool present_handle_event(xcb_generic_event_t *event) {
+    return false;
+}
+
+#endif
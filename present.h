@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+/**
+ * Requests the extension data needed by present_init() without waiting for
+ * it. Does nothing if i3lock was built without Present support.
+ *
+ */
+void prefetch_present(void);
+
+/**
+ * Sets up presenting indicator updates to the given window with the X Present
+ * extension (--present). Returns false if the X server does not support it or
+ * i3lock was built without it, in which case updates keep going through the
+ * window background.
+ *
+ */
+bool present_init(xcb_window_t window);
+
+/**
+ * Returns whether present_init() succeeded.
+ *
+ */
+bool present_active(void);
+
+/**
+ * Copies the given areas of the pixmap to the window on the next vblank and
+ * returns the serial of the frame. present_pending() is true until the X
+ * server reports the frame as presented.
+ *
+ */
+uint32_t present_frame(xcb_pixmap_t pixmap, const xcb_rectangle_t *rects, int n);
+
+/**
+ * Returns for how many more seconds the next frame should wait for the
+ * previous one to be presented, or 0 if it does not need to wait. Gives up
+ * on frames which are not reported as presented after a while.
+ *
+ */
+double present_pending(void);
+
+/**
+ * Handles a PresentCompleteNotify event. Returns false if the given event is
+ * no Present event.
+ *
+ */
+bool present_handle_event(xcb_generic_event_t *event);
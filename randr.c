@@ -17,6 +17,7 @@
 #include "i3lock.h"
 #include "xcb.h"
 #include "randr.h"
+#include "trace.h"
 
 /* Number of Xinerama screens which are currently present. */
 int xr_screens = 0;
@@ -42,6 +43,7 @@ void randr_init(int *event_base, xcb_window_t root) {
     }
 
     xcb_generic_error_t *err;
+    trace_round_trip("RRQueryVersion");
     xcb_randr_query_version_reply_t *randr_version =
         xcb_randr_query_version_reply(
             conn, xcb_randr_query_version(conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION), &err);
@@ -80,6 +82,7 @@ void _xinerama_init(void) {
     xcb_xinerama_is_active_reply_t *reply;
 
     cookie = xcb_xinerama_is_active(conn);
+    trace_round_trip("XineramaIsActive");
     reply = xcb_xinerama_is_active_reply(conn, cookie, NULL);
     if (!reply)
         return;
@@ -108,6 +111,7 @@ static bool _randr_query_monitors_15(xcb_window_t root) {
     /* RandR 1.5 available at run-time (supported by the server) */
     DEBUG("Querying monitors using RandR 1.5\n");
     xcb_generic_error_t *err;
+    trace_round_trip("RRGetMonitors");
     xcb_randr_get_monitors_reply_t *monitors =
         xcb_randr_get_monitors_reply(
             conn, xcb_randr_get_monitors(conn, root, true), &err);
@@ -167,6 +171,7 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
     xcb_randr_get_screen_resources_current_cookie_t rcookie;
     rcookie = xcb_randr_get_screen_resources_current(conn, root);
 
+    trace_round_trip("RRGetScreenResourcesCurrent");
     xcb_randr_get_screen_resources_current_reply_t *res =
         xcb_randr_get_screen_resources_current_reply(conn, rcookie, NULL);
     if (res == NULL) {
@@ -195,27 +200,43 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
         return true;
     }
 
-    /* Loop through all outputs available for this X11 screen */
-    int screen = 0;
-
+    /* Request the CRTC of each active output, all of them before waiting for
+     * the first reply. */
+    xcb_randr_crtc_t crtcs[len];
+    xcb_randr_get_crtc_info_cookie_t icookie[len];
+    if (len > 0)
+        trace_round_trip("RRGetOutputInfo");
     for (int i = 0; i < len; i++) {
         xcb_randr_get_output_info_reply_t *output;
 
+        crtcs[i] = XCB_NONE;
         if ((output = xcb_randr_get_output_info_reply(conn, ocookie[i], NULL)) == NULL) {
             continue;
         }
 
-        if (output->crtc == XCB_NONE) {
-            free(output);
+        crtcs[i] = output->crtc;
+        if (crtcs[i] != XCB_NONE)
+            icookie[i] = xcb_randr_get_crtc_info(conn, crtcs[i], cts);
+        free(output);
+    }
+
+    /* Loop through all outputs available for this X11 screen */
+    int screen = 0;
+    bool waited = false;
+
+    for (int i = 0; i < len; i++) {
+        xcb_randr_get_crtc_info_reply_t *crtc;
+
+        if (crtcs[i] == XCB_NONE) {
             continue;
         }
 
-        xcb_randr_get_crtc_info_cookie_t icookie;
-        xcb_randr_get_crtc_info_reply_t *crtc;
-        icookie = xcb_randr_get_crtc_info(conn, output->crtc, cts);
-        if ((crtc = xcb_randr_get_crtc_info_reply(conn, icookie, NULL)) == NULL) {
-            DEBUG("Skipping output: could not get CRTC (0x%08x)\n", output->crtc);
-            free(output);
+        if (!waited) {
+            trace_round_trip("RRGetCrtcInfo");
+            waited = true;
+        }
+        if ((crtc = xcb_randr_get_crtc_info_reply(conn, icookie[i], NULL)) == NULL) {
+            DEBUG("Skipping output: could not get CRTC (0x%08x)\n", crtcs[i]);
             continue;
         }
 
@@ -231,8 +252,6 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
         screen++;
 
         free(crtc);
-
-        free(output);
     }
     free(xr_resolutions);
     xr_resolutions = resolutions;
@@ -251,6 +270,7 @@ void _xinerama_query_screens(void) {
     xcb_xinerama_screen_info_t *screen_info;
     xcb_generic_error_t *err;
     cookie = xcb_xinerama_query_screens_unchecked(conn);
+    trace_round_trip("XineramaQueryScreens");
     reply = xcb_xinerama_query_screens_reply(conn, cookie, &err);
     if (!reply) {
         DEBUG("Couldn't get Xinerama screens: X11 error code %d\n", err->error_code);
@@ -0,0 +1,377 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+/* Grabbing can take thousands of attempts, there is no point in recording
+ * all of them. Anything beyond this is only counted. */
+#define TRACE_MAX_RECORDS 1024
+
+typedef struct trace_record {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+    /* Whether this is a single point in time (trace_mark()). */
+    bool mark;
+    /* The context which was active when the phase began. */
+    const char *parent;
+} trace_record_t;
+
+static bool enabled = false;
+static char *report_path;
+/* Only the process which called trace_init() writes the report, not any of
+ * its fork()ed children, unless it was handed over (see trace_hand_over()). */
+static pid_t trace_pid;
+static uint64_t start;
+static trace_format_t report_format = TRACE_FORMAT_JSON;
+
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_record_t records[TRACE_MAX_RECORDS];
+static int num_records = 0;
+static int dropped = 0;
+
+/* Latencies are kept in a histogram with 16 linear sub-buckets per power of
+ * two microseconds, so percentiles are accurate to about 6%, no matter
+ * whether they are in the microsecond or in the second range. */
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 40)
+#define TRACE_MAX_HISTOGRAMS 8
+
+typedef struct trace_histogram {
+    const char *name;
+    uint32_t count;
+    uint64_t max_us;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} trace_histogram_t;
+
+static trace_histogram_t histograms[TRACE_MAX_HISTOGRAMS];
+static int num_histograms = 0;
+
+/* Blocking round trips to the X server, per context and request. */
+#define TRACE_MAX_ROUND_TRIPS 64
+
+typedef struct trace_round_trips {
+    const char *context;
+    const char *request;
+    uint32_t count;
+} trace_round_trips_t;
+
+static trace_round_trips_t round_trips[TRACE_MAX_ROUND_TRIPS];
+static int num_round_trips = 0;
+
+static __thread const char *context = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int add_record(const char *name, bool mark) {
+    uint64_t ts = now_ns();
+    int id = -1;
+
+    pthread_mutex_lock(&records_lock);
+    if (num_records < TRACE_MAX_RECORDS) {
+        id = num_records++;
+        records[id] = (trace_record_t){name, ts, (mark ? ts : 0), mark, context};
+    } else {
+        dropped++;
+    }
+    pthread_mutex_unlock(&records_lock);
+
+    return id;
+}
+
+static int histogram_bucket(uint64_t us) {
+    if (us < HISTOGRAM_SUB_BUCKETS)
+        return us;
+
+    /* The position of the highest bit is at least 4 here. */
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (us >> (exp - 4)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    int bucket = (exp - 3) * HISTOGRAM_SUB_BUCKETS + sub;
+    return (bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1);
+}
+
+/*
+ * Returns the upper bound (in microseconds) of the values in the given bucket.
+ *
+ */
+static uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    int exp = bucket / HISTOGRAM_SUB_BUCKETS + 3;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exp - 4)) - 1;
+}
+
+static uint64_t histogram_percentile(const trace_histogram_t *h, double percentile) {
+    uint32_t rank = (uint32_t)(h->count * percentile / 100.0 + 0.5);
+    uint32_t seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (int c = 0; c < HISTOGRAM_BUCKETS; c++) {
+        seen += h->buckets[c];
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(c);
+            return (limit < h->max_us ? limit : h->max_us);
+        }
+    }
+    return h->max_us;
+}
+
+static const double percentiles[] = {50, 90, 99};
+
+/*
+ * Writes the report as JSON, one phase per line. Timestamps are in
+ * microseconds since trace_init(), whose CLOCK_MONOTONIC value is given as
+ * origin_ns, so that a benchmark driver can relate them to e.g. the time at
+ * which it executed i3lock. Phases which did not end (e.g. because we exited
+ * while still grabbing) have an end_us of null.
+ *
+ */
+static void write_json(FILE *out) {
+    fprintf(out, "{\"pid\": %d, \"clock\": \"monotonic\", \"origin_ns\": %" PRIu64 ", \"dropped\": %d, \"phases\": [\n",
+            (int)trace_pid, start, dropped);
+    for (int c = 0; c < num_records; c++) {
+        const trace_record_t *r = &records[c];
+        fprintf(out, "  {\"name\": \"%s\", \"begin_us\": %.1f, ", r->name, (r->begin - start) / 1000.0);
+        if (r->end == 0)
+            fprintf(out, "\"end_us\": null, \"duration_us\": null");
+        else
+            fprintf(out, "\"end_us\": %.1f, \"duration_us\": %.1f",
+                    (r->end - start) / 1000.0, (r->end - r->begin) / 1000.0);
+        fprintf(out, ", \"mark\": %s}%s\n", (r->mark ? "true" : "false"), (c < num_records - 1 ? "," : ""));
+    }
+    fprintf(out, "], \"latencies\": [\n");
+    for (int c = 0; c < num_histograms; c++) {
+        const trace_histogram_t *h = &histograms[c];
+        fprintf(out, "  {\"name\": \"%s\", \"count\": %u", h->name, h->count);
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+            fprintf(out, ", \"p%.0f_us\": %" PRIu64, percentiles[p], histogram_percentile(h, percentiles[p]));
+        fprintf(out, ", \"max_us\": %" PRIu64 "}%s\n", h->max_us, (c < num_histograms - 1 ? "," : ""));
+    }
+    fprintf(out, "], \"round_trips\": [\n");
+    for (int c = 0; c < num_round_trips; c++) {
+        const trace_round_trips_t *rt = &round_trips[c];
+        fprintf(out, "  {\"context\": \"%s\", \"request\": \"%s\", \"count\": %u}%s\n",
+                rt->context, rt->request, rt->count, (c < num_round_trips - 1 ? "," : ""));
+    }
+    fprintf(out, "]}\n");
+}
+
+/*
+ * Writes the report as CSV with a header line. Besides the times relative to
+ * trace_init(), the absolute CLOCK_MONOTONIC timestamps are included. Fields
+ * of phases which did not end are left empty.
+ *
+ */
+static void write_csv(FILE *out) {
+    fprintf(out, "pid,name,mark,begin_ns,end_ns,begin_us,end_us,duration_us\n");
+    for (int c = 0; c < num_records; c++) {
+        const trace_record_t *r = &records[c];
+        fprintf(out, "%d,%s,%d,%" PRIu64 ",", (int)trace_pid, r->name, r->mark, r->begin);
+        if (r->end == 0)
+            fprintf(out, ",%.1f,,\n", (r->begin - start) / 1000.0);
+        else
+            fprintf(out, "%" PRIu64 ",%.1f,%.1f,%.1f\n", r->end, (r->begin - start) / 1000.0,
+                    (r->end - start) / 1000.0, (r->end - r->begin) / 1000.0);
+    }
+    /* Latency percentiles are written as lines named e.g. key_normal.p99, with
+     * only the duration set. key_normal.count has the number of latencies. */
+    for (int c = 0; c < num_histograms; c++) {
+        const trace_histogram_t *h = &histograms[c];
+        fprintf(out, "%d,%s.count,0,,,,,%u\n", (int)trace_pid, h->name, h->count);
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+            fprintf(out, "%d,%s.p%.0f,0,,,,,%" PRIu64 "\n", (int)trace_pid, h->name, percentiles[p],
+                    histogram_percentile(h, percentiles[p]));
+        fprintf(out, "%d,%s.max,0,,,,,%" PRIu64 "\n", (int)trace_pid, h->name, h->max_us);
+    }
+    /* Likewise, round trips are written as lines named e.g.
+     * round_trips/KeyPress/GetGeometry, with the count as duration. */
+    for (int c = 0; c < num_round_trips; c++) {
+        const trace_round_trips_t *rt = &round_trips[c];
+        fprintf(out, "%d,round_trips/%s/%s,0,,,,,%u\n", (int)trace_pid, rt->context, rt->request, rt->count);
+    }
+    if (dropped > 0)
+        fprintf(stderr, "[i3lock] trace: %d records dropped\n", dropped);
+}
+
+static void write_report(void) {
+    FILE *out = stderr;
+
+    if (!enabled || getpid() != trace_pid)
+        return;
+
+    if (report_path != NULL && (out = fopen(report_path, "w")) == NULL) {
+        warn("Could not write trace to %s", report_path);
+        return;
+    }
+
+    pthread_mutex_lock(&records_lock);
+    if (report_format == TRACE_FORMAT_CSV)
+        write_csv(out);
+    else
+        write_json(out);
+    pthread_mutex_unlock(&records_lock);
+
+    if (out != stderr)
+        fclose(out);
+}
+
+void trace_init(const char *path) {
+    if (enabled)
+        return;
+
+    start = now_ns();
+    trace_pid = getpid();
+    if (path != NULL && (report_path = strdup(path)) == NULL)
+        err(EXIT_FAILURE, "strdup()");
+    enabled = true;
+    atexit(write_report);
+}
+
+void trace_hand_over(pid_t pid) {
+    trace_pid = pid;
+}
+
+void trace_set_format(trace_format_t format) {
+    report_format = format;
+}
+
+bool trace_enabled(void) {
+    return enabled;
+}
+
+int trace_begin(const char *name) {
+    if (!enabled)
+        return -1;
+
+    int id = add_record(name, false);
+    if (id >= 0)
+        context = name;
+    return id;
+}
+
+void trace_end(int id) {
+    if (!enabled || id < 0)
+        return;
+
+    uint64_t ts = now_ns();
+    pthread_mutex_lock(&records_lock);
+    records[id].end = ts;
+    /* Phases like grabbing end in a different context than they began in, so
+     * only restore the context if it is still ours. */
+    if (context == records[id].name)
+        context = records[id].parent;
+    pthread_mutex_unlock(&records_lock);
+}
+
+void trace_phase(const char *name, uint64_t begin, uint64_t end) {
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&records_lock);
+    if (num_records < TRACE_MAX_RECORDS)
+        records[num_records++] = (trace_record_t){name, begin, end, false, NULL};
+    else
+        dropped++;
+    pthread_mutex_unlock(&records_lock);
+}
+
+void trace_mark(const char *name) {
+    if (enabled)
+        (void)add_record(name, true);
+}
+
+uint64_t trace_now(void) {
+    return (enabled ? now_ns() : 0);
+}
+
+void trace_latency(const char *name, uint64_t begin) {
+    if (!enabled || begin == 0)
+        return;
+
+    trace_latency_until(name, begin, now_ns());
+}
+
+void trace_latency_until(const char *name, uint64_t begin, uint64_t end) {
+    if (!enabled || begin == 0 || end < begin)
+        return;
+
+    uint64_t us = (end - begin) / 1000;
+    trace_histogram_t *h = NULL;
+
+    pthread_mutex_lock(&records_lock);
+    for (int c = 0; c < num_histograms; c++) {
+        if (strcmp(histograms[c].name, name) == 0) {
+            h = &histograms[c];
+            break;
+        }
+    }
+    if (h == NULL && num_histograms < TRACE_MAX_HISTOGRAMS) {
+        h = &histograms[num_histograms++];
+        h->name = name;
+    }
+    if (h != NULL) {
+        h->count++;
+        h->buckets[histogram_bucket(us)]++;
+        if (us > h->max_us)
+            h->max_us = us;
+    }
+    pthread_mutex_unlock(&records_lock);
+}
+
+const char *trace_context(const char *name) {
+    const char *previous = context;
+
+    if (enabled)
+        context = name;
+    return previous;
+}
+
+void trace_round_trip(const char *request) {
+    if (!enabled)
+        return;
+
+    const char *ctx = (context != NULL ? context : "idle");
+    trace_round_trips_t *rt = NULL;
+
+    pthread_mutex_lock(&records_lock);
+    for (int c = 0; c < num_round_trips; c++) {
+        if (strcmp(round_trips[c].context, ctx) == 0 &&
+            strcmp(round_trips[c].request, request) == 0) {
+            rt = &round_trips[c];
+            break;
+        }
+    }
+    if (rt == NULL && num_round_trips < TRACE_MAX_ROUND_TRIPS) {
+        rt = &round_trips[num_round_trips++];
+        rt->context = ctx;
+        rt->request = request;
+    }
+    if (rt != NULL)
+        rt->count++;
+    else
+        dropped++;
+    pthread_mutex_unlock(&records_lock);
+}
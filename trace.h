@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum {
+    TRACE_FORMAT_JSON = 0,
+    TRACE_FORMAT_CSV = 1,
+} trace_format_t;
+
+/**
+ * Enables tracing (--trace-startup). The report is written to the given file
+ * (or stderr if path is NULL) when the process exits. Should be called as
+ * early as possible, since all timestamps are relative to this call.
+ *
+ */
+void trace_init(const char *path);
+
+/**
+ * Makes the given process write the report instead of the current one. To be
+ * called on both sides of a fork() after which the parent exits, since only
+ * the child records the rest of the run (e.g. key latencies).
+ *
+ */
+void trace_hand_over(pid_t pid);
+
+/**
+ * Selects the format of the report (--trace-format).
+ *
+ */
+void trace_set_format(trace_format_t format);
+
+/**
+ * Returns whether tracing was enabled with trace_init().
+ *
+ */
+bool trace_enabled(void);
+
+/**
+ * Records the beginning of a phase and returns its id, to be passed to
+ * trace_end(). The name must be a string constant. Thread-safe.
+ *
+ */
+int trace_begin(const char *name);
+
+/**
+ * Records the end of the phase returned by trace_begin(). Thread-safe.
+ *
+ */
+void trace_end(int id);
+
+/**
+ * Records a phase whose CLOCK_MONOTONIC timestamps were taken elsewhere, e.g.
+ * in a child process.
+ *
+ */
+void trace_phase(const char *name, uint64_t begin, uint64_t end);
+
+/**
+ * Records a single point in time, e.g. receiving an event.
+ *
+ */
+void trace_mark(const char *name);
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds if tracing is
+ * enabled, 0 otherwise. Pass it to trace_latency() later.
+ *
+ */
+uint64_t trace_now(void);
+
+/**
+ * Adds the time elapsed since begin (as returned by trace_now()) to the
+ * latency histogram with the given name, which must be a string constant.
+ * The report contains percentiles for each histogram.
+ *
+ */
+void trace_latency(const char *name, uint64_t begin);
+
+/**
+ * Like trace_latency(), but for a latency which ended at the given
+ * CLOCK_MONOTONIC time in nanoseconds, e.g. when a frame became visible.
+ *
+ */
+void trace_latency_until(const char *name, uint64_t begin, uint64_t end);
+
+/**
+ * Sets the context to which the calling thread's round trips are attributed
+ * (e.g. the type of the X11 event being handled) and returns the previous one,
+ * so that it can be restored. trace_begin() sets the context to the phase's
+ * name until the matching trace_end(). The name must be a string constant.
+ *
+ */
+const char *trace_context(const char *name);
+
+/**
+ * Counts a blocking round trip to the X server, i.e. waiting for the reply to
+ * the given request (a string constant), in the current context. Library
+ * calls which wait for several replies are counted once per call. Called by
+ * hand before each wait, so the counts are lower bounds: round trips inside
+ * cairo-xcb or xkbcommon-x11 are not seen.
+ *
+ */
+void trace_round_trip(const char *request);
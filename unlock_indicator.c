@@ -21,6 +21,8 @@
 #include "unlock_indicator.h"
 #include "randr.h"
 #include "dpi.h"
+#include "trace.h"
+#include "present.h"
 
 #define BUTTON_RADIUS 90
 #define BUTTON_SPACE (BUTTON_RADIUS + 5)
@@ -46,14 +48,18 @@ extern uint32_t last_resolution[2];
 /* Whether the unlock indicator is enabled (defaults to true). */
 extern bool unlock_indicator;
 
-/* List of pressed modifiers, or NULL if none are pressed. */
-extern char *modifier_string;
+/* List of pressed modifiers, or empty if none are pressed. */
+extern char modifier_string[MODIFIER_STRING_SIZE];
 
 /* A Cairo surface containing the specified image (-i), if any. */
 extern cairo_surface_t *img;
+/* The shared memory backing img, if any. */
+extern shm_image_t *img_shm;
 
 /* Whether the image should be tiled. */
 extern bool tile;
+/* How the image should be placed on each screen. */
+extern image_mode_t image_mode;
 /* The background color to use (in hex). */
 extern char color[7];
 
@@ -62,6 +68,8 @@ extern bool show_failed_attempts;
 /* Number of failed unlock attempts. */
 extern int failed_attempts;
 
+extern struct ev_loop *main_loop;
+
 /*******************************************************************************
  * Variables defined in xcb.c.
  ******************************************************************************/
@@ -81,270 +89,1217 @@ static xcb_visualtype_t *vistype;
 unlock_state_t unlock_state;
 auth_state_t auth_state;
 
+/* A pixmap on the X server with a cairo surface and context for drawing
+ * onto it. */
+typedef struct {
+    xcb_pixmap_t pixmap;
+    cairo_surface_t *surface;
+    cairo_t *ctx;
+} render_target_t;
+
+/* Everything the lock window is rendered with. The targets are allocated for
+ * one resolution and kept until it changes (see alloc_render_targets()), so
+ * that neither redraws nor screen layout changes need to allocate any. */
+typedef struct {
+    uint32_t resolution[2];
+    /* The clean background (color and/or image, without the unlock
+     * indicator), so that keypresses only need to redraw the indicator. */
+    render_target_t bg;
+    /* The window pixmaps (bg plus the unlock indicator), double-buffered: the
+     * window shows buffers[front], the next frame is drawn into the other
+     * one, so that we never draw into what is being displayed. */
+    render_target_t buffers[2];
+    int front;
+    /* Whether bg was rendered, and for which screen layout. */
+    bool bg_valid;
+    Rect *layout;
+    int screens;
+} render_context_t;
+
+static render_context_t render_ctx;
+
+/* The image (-i) on top of the background color, uploaded once per lock
+ * session when tiling (-t), so that the X server can repeat it. */
+static xcb_pixmap_t tile_pixmap = XCB_NONE;
+
+/* The image (-i), scaled and placed for one screen size. */
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    xcb_pixmap_t pixmap;
+    /* Screens of the same size share one pixmap, only one of them owns it. */
+    bool owned;
+} screen_bg_t;
+
+/* The per-screen images for the current screen layout, see image_mode. */
+static screen_bg_t *screen_bgs = NULL;
+static int num_screen_bgs = 0;
+
+/* Everything the unlock indicator shows, captured when a redraw is requested
+ * (see redraw_screen()), since the frame is only rendered later on. */
+typedef struct {
+    unlock_state_t unlock_state;
+    auth_state_t auth_state;
+    int failed_attempts;
+    char modifier_string[MODIFIER_STRING_SIZE];
+    /* Where the keypress highlight starts (in radians), or -1 if there is
+     * none. Every keypress gets a new (random) one. */
+    double highlight_start;
+} indicator_state_t;
+
+/* Redraws are rendered from an ev_prepare watcher (i.e. once all pending
+ * events were handled), at most once per FRAME_INTERVAL (or, with --present,
+ * once the previous frame was presented). Requests in between are coalesced,
+ * only the last state is rendered. */
+#define FRAME_INTERVAL (1.0 / 60)
+
+static bool redraw_pending = false;
+/* Whether a key press requested the pending redraw, whose allocations are
+ * counted then (see check_key_allocations()). */
+static bool key_frame_pending = false;
+static indicator_state_t pending_state;
+/* What the lock window currently shows. */
+static indicator_state_t drawn_state;
+static bool drawn_valid = false;
+static ev_tstamp last_frame = 0;
+static struct ev_prepare redraw_prepare;
+static struct ev_timer frame_timer;
+
+/* Key presses waiting for the next frame, for --trace-startup. Large enough
+ * for a password typed by a password manager or hardware token at once. */
+#define MAX_PENDING_LATENCIES 128
+static struct {
+    const char *name;
+    uint64_t pressed;
+} pending_latencies[MAX_PENDING_LATENCIES];
+static int num_pending_latencies = 0;
+
+/* With --present: the key presses shown by the frame which is waiting to be
+ * presented, to measure the time until they became visible. */
+static uint64_t presented_latencies[MAX_PENDING_LATENCIES];
+static int num_presented_latencies = 0;
+static uint32_t presented_serial = 0;
+
+/* Pre-rendered unlock indicator frames (everything but the keypress
+ * highlight), stored on the X server so that a state change costs a single
+ * composite. Keyed by state and scaling factor. */
+#define SPRITE_CACHE_SIZE 16
+
+typedef struct {
+    double scaling_factor;
+    auth_state_t auth_state;
+    unlock_state_t unlock_state;
+    int failed_attempts;
+    char *modifier_string;
+
+    cairo_surface_t *surface;
+} indicator_sprite_t;
+
+static indicator_sprite_t sprites[SPRITE_CACHE_SIZE];
+static int next_sprite = 0;
+
+/* The texts of the unlock indicator, laid out once per scaling factor (see
+ * update_label_cache()), so that rendering a frame does not need to look up
+ * fonts or measure text. */
+typedef enum {
+    LABEL_VERIFYING = 0,
+    LABEL_LOCKING,
+    LABEL_WRONG,
+    LABEL_LOCK_FAILED,
+    LABEL_NO_INPUT,
+    LABEL_TOO_MANY_ATTEMPTS,
+    NUM_LABELS,
+} label_id_t;
+
+/* Font sizes (before scaling) of the different kinds of text. */
+#define FONT_SIZE_STATE 28.0
+#define FONT_SIZE_ATTEMPTS 32.0
+#define FONT_SIZE_MODIFIERS 14.0
+
+static const struct {
+    const char *text;
+    double size;
+} label_texts[NUM_LABELS] = {
+    [LABEL_VERIFYING] = {"Verifying…", FONT_SIZE_STATE},
+    [LABEL_LOCKING] = {"Locking…", FONT_SIZE_STATE},
+    [LABEL_WRONG] = {"Wrong!", FONT_SIZE_STATE},
+    [LABEL_LOCK_FAILED] = {"Lock failed!", FONT_SIZE_STATE},
+    [LABEL_NO_INPUT] = {"No input", FONT_SIZE_STATE},
+    [LABEL_TOO_MANY_ATTEMPTS] = {"> 999", FONT_SIZE_ATTEMPTS},
+};
+
+/* A glyph run positioned relative to the origin, with its extents. */
+typedef struct {
+    cairo_scaled_font_t *font;
+    cairo_glyph_t *glyphs;
+    int num_glyphs;
+    cairo_text_extents_t extents;
+} label_t;
+
+static struct {
+    double scaling_factor;
+    cairo_font_face_t *face;
+    cairo_scaled_font_t *state_font;
+    cairo_scaled_font_t *attempts_font;
+    cairo_scaled_font_t *modifiers_font;
+    label_t labels[NUM_LABELS];
+    /* The digits 0-9 in attempts_font, for the number of failed attempts. */
+    bool have_digits;
+    unsigned long digit_index[10];
+    cairo_text_extents_t digit_extents[10];
+    /* The most recently shown list of modifiers. */
+    char *modifiers;
+    label_t modifiers_label;
+} label_cache;
+
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Returns true if the unlock indicator should currently be visible.
  *
  */
-xcb_pixmap_t draw_image(uint32_t *resolution) {
-    xcb_pixmap_t bg_pixmap = XCB_NONE;
-    const double scaling_factor = get_dpi_value() / 96.0;
-    int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
-    DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
-          scaling_factor, button_diameter_physical);
+static bool indicator_visible(const indicator_state_t *state) {
+    return (unlock_indicator &&
+            (state->unlock_state >= STATE_KEY_PRESSED || state->auth_state > STATE_AUTH_IDLE));
+}
 
-    if (!vistype)
-        vistype = get_root_visual_type(screen);
-    bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
-    /* Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. */
-    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, button_diameter_physical, button_diameter_physical);
-    cairo_t *ctx = cairo_create(output);
+/*
+ * Fills in the sprite key for the current unlock/auth state. Everything that
+ * does not influence the static part of the indicator is normalized, so that
+ * e.g. all keypresses share the same frame.
+ *
+ */
+static void get_sprite_key(indicator_sprite_t *key, const double scaling_factor, const indicator_state_t *state) {
+    key->scaling_factor = scaling_factor;
+    key->auth_state = state->auth_state;
+    key->unlock_state = STATE_KEY_PRESSED;
+    key->failed_attempts = 0;
+    key->modifier_string = NULL;
 
-    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
-    cairo_t *xcb_ctx = cairo_create(xcb_output);
+    switch (state->auth_state) {
+        case STATE_AUTH_WRONG:
+            if (state->modifier_string[0] != '\0')
+                key->modifier_string = (char *)state->modifier_string;
+            break;
+        case STATE_AUTH_IDLE:
+            if (state->unlock_state == STATE_NOTHING_TO_DELETE)
+                key->unlock_state = STATE_NOTHING_TO_DELETE;
+            if (show_failed_attempts && state->failed_attempts > 0)
+                key->failed_attempts = (state->failed_attempts > 999 ? 1000 : state->failed_attempts);
+            break;
+        default:
+            break;
+    }
+}
 
-    if (img) {
-        if (!tile) {
-            cairo_set_source_surface(xcb_ctx, img, 0, 0);
-            cairo_paint(xcb_ctx);
-        } else {
-            /* create a pattern and fill a rectangle as big as the screen */
-            cairo_pattern_t *pattern;
-            pattern = cairo_pattern_create_for_surface(img);
-            cairo_set_source(xcb_ctx, pattern);
-            cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-            cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-            cairo_fill(xcb_ctx);
-            cairo_pattern_destroy(pattern);
-        }
+static bool sprite_key_equal(const indicator_sprite_t *a, const indicator_sprite_t *b) {
+    if (a->scaling_factor != b->scaling_factor ||
+        a->auth_state != b->auth_state ||
+        a->unlock_state != b->unlock_state ||
+        a->failed_attempts != b->failed_attempts)
+        return false;
+
+    if (a->modifier_string == NULL || b->modifier_string == NULL)
+        return (a->modifier_string == b->modifier_string);
+
+    return (strcmp(a->modifier_string, b->modifier_string) == 0);
+}
+
+static void free_label(label_t *label) {
+    cairo_glyph_free(label->glyphs);
+    memset(label, '\0', sizeof(label_t));
+}
+
+/*
+ * Lays out the given text in the given font. On error, the label stays empty
+ * (and is not shown).
+ *
+ */
+static void layout_label(label_t *label, cairo_scaled_font_t *font, const char *text) {
+    label->font = font;
+    /* cairo would write into (or free) a non-NULL glyph buffer we pass. */
+    label->glyphs = NULL;
+    label->num_glyphs = 0;
+    if (cairo_scaled_font_text_to_glyphs(font, 0, 0, text, -1, &label->glyphs, &label->num_glyphs,
+                                         NULL, NULL, NULL) != CAIRO_STATUS_SUCCESS) {
+        label->glyphs = NULL;
+        label->num_glyphs = 0;
+        return;
+    }
+    cairo_scaled_font_glyph_extents(font, label->glyphs, label->num_glyphs, &label->extents);
+}
+
+static cairo_scaled_font_t *create_label_font(double size, double scaling_factor) {
+    cairo_matrix_t font_matrix, ctm;
+    cairo_matrix_init_scale(&font_matrix, size, size);
+    /* The same transformation draw_indicator_frame() draws with. */
+    cairo_matrix_init_scale(&ctm, scaling_factor, scaling_factor);
+    cairo_font_options_t *options = cairo_font_options_create();
+    cairo_scaled_font_t *font = cairo_scaled_font_create(label_cache.face, &font_matrix, &ctm, options);
+    cairo_font_options_destroy(options);
+    return font;
+}
+
+/*
+ * Makes sure that the fonts and fixed labels are laid out for the given
+ * scaling factor. Since that only changes with the DPI, this usually happens
+ * once for the first indicator frame.
+ *
+ */
+static void update_label_cache(double scaling_factor) {
+    if (label_cache.face != NULL && label_cache.scaling_factor == scaling_factor)
+        return;
+
+    DEBUG("laying out labels for scaling factor %.2f\n", scaling_factor);
+    for (int i = 0; i < NUM_LABELS; i++)
+        free_label(&label_cache.labels[i]);
+    free_label(&label_cache.modifiers_label);
+    free(label_cache.modifiers);
+    label_cache.modifiers = NULL;
+    if (label_cache.face != NULL) {
+        cairo_scaled_font_destroy(label_cache.state_font);
+        cairo_scaled_font_destroy(label_cache.attempts_font);
+        cairo_scaled_font_destroy(label_cache.modifiers_font);
     } else {
-        char strgroups[3][3] = {{color[0], color[1], '\0'},
-                                {color[2], color[3], '\0'},
-                                {color[4], color[5], '\0'}};
-        uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
-                             (strtol(strgroups[1], NULL, 16)),
-                             (strtol(strgroups[2], NULL, 16))};
-        cairo_set_source_rgb(xcb_ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
-        cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-        cairo_fill(xcb_ctx);
+        label_cache.face = cairo_toy_font_face_create("sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
     }
 
-    if (unlock_indicator &&
-        (unlock_state >= STATE_KEY_PRESSED || auth_state > STATE_AUTH_IDLE)) {
-        cairo_scale(ctx, scaling_factor, scaling_factor);
-        /* Draw a (centered) circle with transparent background. */
-        cairo_set_line_width(ctx, 10.0);
-        cairo_arc(ctx,
-                  BUTTON_CENTER /* x */,
-                  BUTTON_CENTER /* y */,
-                  BUTTON_RADIUS /* radius */,
-                  0 /* start */,
-                  2 * M_PI /* end */);
-
-        /* Use the appropriate color for the different PAM states
-         * (currently verifying, wrong password, or default) */
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-            case STATE_AUTH_LOCK:
-                cairo_set_source_rgba(ctx, 0, 114.0 / 255, 255.0 / 255, 0.75);
-                break;
-            case STATE_AUTH_WRONG:
-            case STATE_I3LOCK_LOCK_FAILED:
+    label_cache.scaling_factor = scaling_factor;
+    label_cache.state_font = create_label_font(FONT_SIZE_STATE, scaling_factor);
+    label_cache.attempts_font = create_label_font(FONT_SIZE_ATTEMPTS, scaling_factor);
+    label_cache.modifiers_font = create_label_font(FONT_SIZE_MODIFIERS, scaling_factor);
+
+    for (int i = 0; i < NUM_LABELS; i++) {
+        cairo_scaled_font_t *font = (label_texts[i].size == FONT_SIZE_ATTEMPTS ? label_cache.attempts_font : label_cache.state_font);
+        layout_label(&label_cache.labels[i], font, label_texts[i].text);
+    }
+
+    /* The digits are laid out individually, see layout_attempts(). */
+    label_t digits = {0};
+    layout_label(&digits, label_cache.attempts_font, "0123456789");
+    label_cache.have_digits = (digits.num_glyphs == 10);
+    for (int i = 0; i < digits.num_glyphs && label_cache.have_digits; i++) {
+        cairo_glyph_t glyph = {digits.glyphs[i].index, 0, 0};
+        label_cache.digit_index[i] = glyph.index;
+        cairo_scaled_font_glyph_extents(label_cache.attempts_font, &glyph, 1, &label_cache.digit_extents[i]);
+    }
+    free_label(&digits);
+}
+
+/*
+ * Lays out the number of failed attempts (up to 3 digits) from the cached
+ * digits into the given label, whose glyphs are stored in the given array.
+ * Returns false if the digits are not available.
+ *
+ */
+static bool layout_attempts(label_t *label, cairo_glyph_t glyphs[3], int attempts) {
+    char buf[4];
+    int n = snprintf(buf, sizeof(buf), "%d", attempts);
+    if (!label_cache.have_digits || n < 1 || n > 3)
+        return false;
+
+    double pen = 0, x_min = 0, x_max = 0, y_min = 0, y_max = 0;
+    for (int i = 0; i < n; i++) {
+        const cairo_text_extents_t *e = &label_cache.digit_extents[buf[i] - '0'];
+        glyphs[i].index = label_cache.digit_index[buf[i] - '0'];
+        glyphs[i].x = pen;
+        glyphs[i].y = 0;
+
+        /* The ink extents of the run are the union of the glyphs' ones. */
+        if (i == 0 || pen + e->x_bearing < x_min)
+            x_min = pen + e->x_bearing;
+        if (i == 0 || pen + e->x_bearing + e->width > x_max)
+            x_max = pen + e->x_bearing + e->width;
+        if (i == 0 || e->y_bearing < y_min)
+            y_min = e->y_bearing;
+        if (i == 0 || e->y_bearing + e->height > y_max)
+            y_max = e->y_bearing + e->height;
+        pen += e->x_advance;
+    }
+
+    label->font = label_cache.attempts_font;
+    label->glyphs = glyphs;
+    label->num_glyphs = n;
+    label->extents = (cairo_text_extents_t){
+        .x_bearing = x_min,
+        .y_bearing = y_min,
+        .width = x_max - x_min,
+        .height = y_max - y_min,
+        .x_advance = pen,
+        .y_advance = 0,
+    };
+    return true;
+}
+
+/*
+ * Returns the label for the given list of modifiers. Only the most recent one
+ * is kept, since it only changes when the keyboard state does.
+ *
+ */
+static const label_t *get_modifiers_label(const char *modifiers) {
+    if (label_cache.modifiers != NULL && strcmp(label_cache.modifiers, modifiers) == 0)
+        return &label_cache.modifiers_label;
+
+    free_label(&label_cache.modifiers_label);
+    free(label_cache.modifiers);
+    if ((label_cache.modifiers = strdup(modifiers)) != NULL)
+        layout_label(&label_cache.modifiers_label, label_cache.modifiers_font, modifiers);
+    return &label_cache.modifiers_label;
+}
+
+/*
+ * Shows the given label centered in the unlock indicator, moved down by
+ * y_offset, in the current source color.
+ *
+ */
+static void show_label(cairo_t *ctx, const label_t *label, double y_offset) {
+    if (label->num_glyphs == 0)
+        return;
+
+    const cairo_text_extents_t *extents = &label->extents;
+    double x = BUTTON_CENTER - ((extents->width / 2) + extents->x_bearing);
+    double y = BUTTON_CENTER - ((extents->height / 2) + extents->y_bearing) + y_offset;
+
+    cairo_save(ctx);
+    cairo_set_scaled_font(ctx, label->font);
+    cairo_translate(ctx, x, y);
+    cairo_show_glyphs(ctx, label->glyphs, label->num_glyphs);
+    cairo_restore(ctx);
+}
+
+/*
+ * Draws the static part of the unlock indicator (ring, fill and text) for the
+ * given state onto ctx, which is expected to be a surface of (scaled)
+ * BUTTON_DIAMETER pixels.
+ *
+ */
+static void draw_indicator_frame(cairo_t *ctx, const indicator_sprite_t *key) {
+    cairo_scale(ctx, key->scaling_factor, key->scaling_factor);
+    /* Draw a (centered) circle with transparent background. */
+    cairo_set_line_width(ctx, 10.0);
+    cairo_arc(ctx,
+              BUTTON_CENTER /* x */,
+              BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */,
+              0 /* start */,
+              2 * M_PI /* end */);
+
+    /* Use the appropriate color for the different PAM states
+     * (currently verifying, wrong password, or default) */
+    switch (key->auth_state) {
+        case STATE_AUTH_VERIFY:
+        case STATE_AUTH_LOCK:
+            cairo_set_source_rgba(ctx, 0, 114.0 / 255, 255.0 / 255, 0.75);
+            break;
+        case STATE_AUTH_WRONG:
+        case STATE_I3LOCK_LOCK_FAILED:
+            cairo_set_source_rgba(ctx, 250.0 / 255, 0, 0, 0.75);
+            break;
+        default:
+            if (key->unlock_state == STATE_NOTHING_TO_DELETE) {
                 cairo_set_source_rgba(ctx, 250.0 / 255, 0, 0, 0.75);
                 break;
-            default:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
-                    cairo_set_source_rgba(ctx, 250.0 / 255, 0, 0, 0.75);
-                    break;
-                }
-                cairo_set_source_rgba(ctx, 0, 0, 0, 0.75);
-                break;
-        }
-        cairo_fill_preserve(ctx);
+            }
+            cairo_set_source_rgba(ctx, 0, 0, 0, 0.75);
+            break;
+    }
+    cairo_fill_preserve(ctx);
 
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-            case STATE_AUTH_LOCK:
-                cairo_set_source_rgb(ctx, 51.0 / 255, 0, 250.0 / 255);
-                break;
-            case STATE_AUTH_WRONG:
-            case STATE_I3LOCK_LOCK_FAILED:
+    switch (key->auth_state) {
+        case STATE_AUTH_VERIFY:
+        case STATE_AUTH_LOCK:
+            cairo_set_source_rgb(ctx, 51.0 / 255, 0, 250.0 / 255);
+            break;
+        case STATE_AUTH_WRONG:
+        case STATE_I3LOCK_LOCK_FAILED:
+            cairo_set_source_rgb(ctx, 125.0 / 255, 51.0 / 255, 0);
+            break;
+        case STATE_AUTH_IDLE:
+            if (key->unlock_state == STATE_NOTHING_TO_DELETE) {
                 cairo_set_source_rgb(ctx, 125.0 / 255, 51.0 / 255, 0);
                 break;
-            case STATE_AUTH_IDLE:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
-                    cairo_set_source_rgb(ctx, 125.0 / 255, 51.0 / 255, 0);
-                    break;
-                }
+            }
 
-                cairo_set_source_rgb(ctx, 51.0 / 255, 125.0 / 255, 0);
-                break;
-        }
-        cairo_stroke(ctx);
-
-        /* Draw an inner seperator line. */
-        cairo_set_source_rgb(ctx, 0, 0, 0);
-        cairo_set_line_width(ctx, 2.0);
-        cairo_arc(ctx,
-                  BUTTON_CENTER /* x */,
-                  BUTTON_CENTER /* y */,
-                  BUTTON_RADIUS - 5 /* radius */,
-                  0,
-                  2 * M_PI);
-        cairo_stroke(ctx);
-
-        cairo_set_line_width(ctx, 10.0);
-
-        /* Display a (centered) text of the current PAM state. */
-        char *text = NULL;
-        /* We don't want to show more than a 3-digit number. */
-        char buf[4];
-
-        cairo_set_source_rgb(ctx, 0, 0, 0);
-        cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(ctx, 28.0);
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-                text = "Verifying…";
-                break;
-            case STATE_AUTH_LOCK:
-                text = "Locking…";
-                break;
-            case STATE_AUTH_WRONG:
-                text = "Wrong!";
-                break;
-            case STATE_I3LOCK_LOCK_FAILED:
-                text = "Lock failed!";
-                break;
-            default:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
-                    text = "No input";
-                }
-                if (show_failed_attempts && failed_attempts > 0) {
-                    if (failed_attempts > 999) {
-                        text = "> 999";
-                    } else {
-                        snprintf(buf, sizeof(buf), "%d", failed_attempts);
-                        text = buf;
-                    }
-                    cairo_set_source_rgb(ctx, 1, 0, 0);
-                    cairo_set_font_size(ctx, 32.0);
+            cairo_set_source_rgb(ctx, 51.0 / 255, 125.0 / 255, 0);
+            break;
+    }
+    cairo_stroke(ctx);
+
+    /* Draw an inner seperator line. */
+    cairo_set_source_rgb(ctx, 0, 0, 0);
+    cairo_set_line_width(ctx, 2.0);
+    cairo_arc(ctx,
+              BUTTON_CENTER /* x */,
+              BUTTON_CENTER /* y */,
+              BUTTON_RADIUS - 5 /* radius */,
+              0,
+              2 * M_PI);
+    cairo_stroke(ctx);
+
+    cairo_set_line_width(ctx, 10.0);
+
+    /* Display a (centered) text of the current PAM state. */
+    const label_t *label = NULL;
+    /* We don't want to show more than a 3-digit number. */
+    label_t attempts;
+    cairo_glyph_t digits[3];
+
+    update_label_cache(key->scaling_factor);
+    cairo_set_source_rgb(ctx, 0, 0, 0);
+    switch (key->auth_state) {
+        case STATE_AUTH_VERIFY:
+            label = &label_cache.labels[LABEL_VERIFYING];
+            break;
+        case STATE_AUTH_LOCK:
+            label = &label_cache.labels[LABEL_LOCKING];
+            break;
+        case STATE_AUTH_WRONG:
+            label = &label_cache.labels[LABEL_WRONG];
+            break;
+        case STATE_I3LOCK_LOCK_FAILED:
+            label = &label_cache.labels[LABEL_LOCK_FAILED];
+            break;
+        default:
+            if (key->unlock_state == STATE_NOTHING_TO_DELETE) {
+                label = &label_cache.labels[LABEL_NO_INPUT];
+            }
+            if (key->failed_attempts > 0) {
+                if (key->failed_attempts > 999) {
+                    label = &label_cache.labels[LABEL_TOO_MANY_ATTEMPTS];
+                } else if (layout_attempts(&attempts, digits, key->failed_attempts)) {
+                    label = &attempts;
                 }
-                break;
-        }
+                cairo_set_source_rgb(ctx, 1, 0, 0);
+            }
+            break;
+    }
 
-        if (text) {
-            cairo_text_extents_t extents;
-            double x, y;
+    if (label)
+        show_label(ctx, label, 0);
 
-            cairo_text_extents(ctx, text, &extents);
-            x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
-            y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing);
+    if (key->auth_state == STATE_AUTH_WRONG && (key->modifier_string != NULL)) {
+        show_label(ctx, get_modifiers_label(key->modifier_string), FONT_SIZE_STATE);
+    }
+}
 
-            cairo_move_to(ctx, x, y);
-            cairo_show_text(ctx, text);
-            cairo_close_path(ctx);
-        }
+/*
+ * After the user pressed any valid key or the backspace key, we highlight a
+ * random part of the unlock indicator to confirm this keypress. This is drawn
+ * directly on top of the (cached) frame, with ctx translated to its origin.
+ *
+ */
+static void draw_indicator_highlight(cairo_t *ctx, const double scaling_factor, const indicator_state_t *state) {
+    if (state->highlight_start < 0)
+        return;
 
-        if (auth_state == STATE_AUTH_WRONG && (modifier_string != NULL)) {
-            cairo_text_extents_t extents;
-            double x, y;
+    cairo_save(ctx);
+    cairo_scale(ctx, scaling_factor, scaling_factor);
+    cairo_set_line_width(ctx, 10.0);
 
-            cairo_set_font_size(ctx, 14.0);
+    cairo_new_sub_path(ctx);
+    const double highlight_start = state->highlight_start;
+    cairo_arc(ctx,
+              BUTTON_CENTER /* x */,
+              BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */,
+              highlight_start,
+              highlight_start + (M_PI / 3.0));
+    if (state->unlock_state == STATE_KEY_ACTIVE) {
+        /* For normal keys, we use a lighter green. */
+        cairo_set_source_rgb(ctx, 51.0 / 255, 219.0 / 255, 0);
+    } else {
+        /* For backspace, we use red. */
+        cairo_set_source_rgb(ctx, 219.0 / 255, 51.0 / 255, 0);
+    }
+    cairo_stroke(ctx);
 
-            cairo_text_extents(ctx, modifier_string, &extents);
-            x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
-            y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing) + 28.0;
+    /* Draw two little separators for the highlighted part of the
+     * unlock indicator. */
+    cairo_set_source_rgb(ctx, 0, 0, 0);
+    cairo_arc(ctx,
+              BUTTON_CENTER /* x */,
+              BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */,
+              highlight_start /* start */,
+              highlight_start + (M_PI / 128.0) /* end */);
+    cairo_stroke(ctx);
+    cairo_arc(ctx,
+              BUTTON_CENTER /* x */,
+              BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */,
+              (highlight_start + (M_PI / 3.0)) - (M_PI / 128.0) /* start */,
+              highlight_start + (M_PI / 3.0) /* end */);
+    cairo_stroke(ctx);
+    cairo_restore(ctx);
+}
 
-            cairo_move_to(ctx, x, y);
-            cairo_show_text(ctx, modifier_string);
-            cairo_close_path(ctx);
-        }
+/*
+ * Drops all cached indicator frames. Called when the screen layout changes.
+ *
+ */
+static void clear_sprite_cache(void) {
+    for (int i = 0; i < SPRITE_CACHE_SIZE; i++) {
+        if (sprites[i].surface == NULL)
+            continue;
+        cairo_surface_destroy(sprites[i].surface);
+        free(sprites[i].modifier_string);
+        memset(&sprites[i], '\0', sizeof(indicator_sprite_t));
+    }
+    next_sprite = 0;
+}
 
-        /* After the user pressed any valid key or the backspace key, we
-         * highlight a random part of the unlock indicator to confirm this
-         * keypress. */
-        if (unlock_state == STATE_KEY_ACTIVE ||
-            unlock_state == STATE_BACKSPACE_ACTIVE) {
-            cairo_new_sub_path(ctx);
-            double highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
-            cairo_arc(ctx,
-                      BUTTON_CENTER /* x */,
-                      BUTTON_CENTER /* y */,
-                      BUTTON_RADIUS /* radius */,
-                      highlight_start,
-                      highlight_start + (M_PI / 3.0));
-            if (unlock_state == STATE_KEY_ACTIVE) {
-                /* For normal keys, we use a lighter green. */
-                cairo_set_source_rgb(ctx, 51.0 / 255, 219.0 / 255, 0);
-            } else {
-                /* For backspace, we use red. */
-                cairo_set_source_rgb(ctx, 219.0 / 255, 51.0 / 255, 0);
-            }
-            cairo_stroke(ctx);
-
-            /* Draw two little separators for the highlighted part of the
-             * unlock indicator. */
-            cairo_set_source_rgb(ctx, 0, 0, 0);
-            cairo_arc(ctx,
-                      BUTTON_CENTER /* x */,
-                      BUTTON_CENTER /* y */,
-                      BUTTON_RADIUS /* radius */,
-                      highlight_start /* start */,
-                      highlight_start + (M_PI / 128.0) /* end */);
-            cairo_stroke(ctx);
-            cairo_arc(ctx,
-                      BUTTON_CENTER /* x */,
-                      BUTTON_CENTER /* y */,
-                      BUTTON_RADIUS /* radius */,
-                      (highlight_start + (M_PI / 3.0)) - (M_PI / 128.0) /* start */,
-                      highlight_start + (M_PI / 3.0) /* end */);
-            cairo_stroke(ctx);
-        }
+/*
+ * Returns the server-side frame for the current state, rendering (and caching)
+ * it first if necessary. similar is used to create the frame with a format that
+ * can be composited onto the window pixmap. Returns NULL on error.
+ *
+ */
+static cairo_surface_t *get_indicator_sprite(cairo_surface_t *similar, const double scaling_factor, int diameter,
+                                             const indicator_state_t *state) {
+    indicator_sprite_t key;
+    get_sprite_key(&key, scaling_factor, state);
+
+    for (int i = 0; i < SPRITE_CACHE_SIZE; i++) {
+        if (sprites[i].surface != NULL && sprite_key_equal(&sprites[i], &key))
+            return sprites[i].surface;
+    }
+
+    DEBUG("rendering indicator frame (auth_state = %d, unlock_state = %d)\n",
+          key.auth_state, key.unlock_state);
+
+    /* The cache keeps its own copy of the modifier string. */
+    char *mods = NULL;
+    if (key.modifier_string != NULL && (mods = strdup(key.modifier_string)) == NULL)
+        return NULL;
+
+    /* Rasterize the frame on the client side, then upload it once into a
+     * server-side (ARGB) surface. */
+    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, diameter, diameter);
+    cairo_t *ctx = cairo_create(output);
+    draw_indicator_frame(ctx, &key);
+    cairo_destroy(ctx);
+
+    cairo_surface_t *sprite = cairo_surface_create_similar(similar, CAIRO_CONTENT_COLOR_ALPHA, diameter, diameter);
+    if (cairo_surface_status(sprite) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(sprite);
+        cairo_surface_destroy(output);
+        free(mods);
+        return NULL;
     }
+    ctx = cairo_create(sprite);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(ctx, output, 0, 0);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+    cairo_surface_destroy(output);
+
+    /* Evict the oldest entry if the cache is full. */
+    indicator_sprite_t *entry = &sprites[next_sprite];
+    next_sprite = (next_sprite + 1) % SPRITE_CACHE_SIZE;
+    if (entry->surface != NULL) {
+        cairo_surface_destroy(entry->surface);
+        free(entry->modifier_string);
+    }
+    *entry = key;
+    entry->modifier_string = mods;
+    entry->surface = sprite;
+
+    return sprite;
+}
 
+/*
+ * Fills in one rectangle per screen, in which the unlock indicator is centered.
+ * Returns the number of rectangles, which is at least 1.
+ *
+ */
+static int indicator_rects(xcb_rectangle_t *rects, int diameter) {
     if (xr_screens > 0) {
-        /* Composite the unlock indicator in the middle of each screen. */
         for (int screen = 0; screen < xr_screens; screen++) {
-            int x = (xr_resolutions[screen].x + ((xr_resolutions[screen].width / 2) - (button_diameter_physical / 2)));
-            int y = (xr_resolutions[screen].y + ((xr_resolutions[screen].height / 2) - (button_diameter_physical / 2)));
-            cairo_set_source_surface(xcb_ctx, output, x, y);
-            cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
-            cairo_fill(xcb_ctx);
+            rects[screen].x = (xr_resolutions[screen].x + ((xr_resolutions[screen].width / 2) - (diameter / 2)));
+            rects[screen].y = (xr_resolutions[screen].y + ((xr_resolutions[screen].height / 2) - (diameter / 2)));
+            rects[screen].width = diameter;
+            rects[screen].height = diameter;
         }
+        return xr_screens;
+    }
+
+    /* We have no information about the screen sizes/positions, so we just
+     * place the unlock indicator in the middle of the X root window and
+     * hope for the best. */
+    rects[0].x = (last_resolution[0] / 2) - (diameter / 2);
+    rects[0].y = (last_resolution[1] / 2) - (diameter / 2);
+    rects[0].width = diameter;
+    rects[0].height = diameter;
+    return 1;
+}
+
+/*
+ * Sets the background color (-c) as the source of the given context.
+ *
+ */
+static void set_source_color(cairo_t *ctx) {
+    char strgroups[3][3] = {{color[0], color[1], '\0'},
+                            {color[2], color[3], '\0'},
+                            {color[4], color[5], '\0'}};
+    uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
+                         (strtol(strgroups[1], NULL, 16)),
+                         (strtol(strgroups[2], NULL, 16))};
+    cairo_set_source_rgb(ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
+}
+
+/*
+ * Renders img, placed according to image_mode, on top of the background color
+ * into a new pixmap of the given (screen) size.
+ *
+ * The scaling is done by cairo’s image backend (pixman, which uses SIMD where
+ * available), and the result is uploaded once via MIT-SHM if possible.
+ *
+ */
+static xcb_pixmap_t render_screen_background(uint16_t width, uint16_t height) {
+    uint32_t size[2] = {width, height};
+    const double img_width = cairo_image_surface_get_width(img);
+    const double img_height = cairo_image_surface_get_height(img);
+    DEBUG("scaling %.fx%.f image to %dx%d (mode %d)\n",
+          img_width, img_height, width, height, image_mode);
+
+    xcb_pixmap_t pixmap = create_bg_pixmap(conn, screen, size, color);
+
+    shm_image_t *shm = NULL;
+    cairo_surface_t *output;
+    if (shm_image_format_supported(conn, screen->root_depth) &&
+        (shm = shm_image_create(width, height)) != NULL) {
+        output = cairo_image_surface_create_for_data(shm->data, CAIRO_FORMAT_RGB24, width, height, shm->stride);
     } else {
-        /* We have no information about the screen sizes/positions, so we just
-         * place the unlock indicator in the middle of the X root window and
-         * hope for the best. */
-        int x = (last_resolution[0] / 2) - (button_diameter_physical / 2);
-        int y = (last_resolution[1] / 2) - (button_diameter_physical / 2);
-        cairo_set_source_surface(xcb_ctx, output, x, y);
-        cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
-        cairo_fill(xcb_ctx);
+        output = cairo_xcb_surface_create(conn, pixmap, vistype, width, height);
     }
+    cairo_t *ctx = cairo_create(output);
+
+    set_source_color(ctx);
+    cairo_paint(ctx);
 
-    cairo_surface_destroy(xcb_output);
+    double scale_x = width / img_width;
+    double scale_y = height / img_height;
+    switch (image_mode) {
+        case IMAGE_MODE_FILL:
+            scale_x = scale_y = (scale_x > scale_y ? scale_x : scale_y);
+            break;
+        case IMAGE_MODE_FIT:
+            scale_x = scale_y = (scale_x < scale_y ? scale_x : scale_y);
+            break;
+        case IMAGE_MODE_STRETCH:
+            break;
+        default:
+            scale_x = scale_y = 1.0;
+            break;
+    }
+
+    cairo_translate(ctx,
+                    (width - img_width * scale_x) / 2,
+                    (height - img_height * scale_y) / 2);
+    cairo_scale(ctx, scale_x, scale_y);
+    cairo_set_source_surface(ctx, img, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(ctx), CAIRO_FILTER_GOOD);
+    /* Avoid blending the image edges with the background color when the
+     * image covers the whole screen anyway. */
+    if (image_mode == IMAGE_MODE_FILL || image_mode == IMAGE_MODE_STRETCH)
+        cairo_pattern_set_extend(cairo_get_source(ctx), CAIRO_EXTEND_PAD);
+    cairo_paint(ctx);
+
+    cairo_destroy(ctx);
     cairo_surface_destroy(output);
+
+    if (shm != NULL) {
+        shm_image_put(conn, pixmap, screen->root_depth, shm, 0, 0, width, height, 0, 0);
+        shm_image_free(conn, shm);
+    }
+
+    return pixmap;
+}
+
+/*
+ * Copies the (scaled) image for each screen into the background. The per-screen
+ * images are cached for the whole lock session, so only screens whose size
+ * changed are re-rendered.
+ *
+ */
+static void draw_screen_backgrounds(uint32_t *resolution) {
+    Rect root = {0, 0, resolution[0], resolution[1]};
+    Rect *screens = (xr_screens > 0 ? xr_resolutions : &root);
+    const int n = (xr_screens > 0 ? xr_screens : 1);
+
+    screen_bg_t *bgs = calloc(n, sizeof(screen_bg_t));
+    /* No memory? Then there will be no image, but the screen stays locked. */
+    if (bgs == NULL)
+        return;
+
+    xcb_gcontext_t gc = xcb_generate_id(conn);
+    xcb_create_gc(conn, gc, render_ctx.bg.pixmap, 0, NULL);
+
+    for (int i = 0; i < n; i++) {
+        bgs[i].width = screens[i].width;
+        bgs[i].height = screens[i].height;
+        bgs[i].pixmap = XCB_NONE;
+
+        /* Screens of the same size share the same image. */
+        for (int j = 0; j < i && bgs[i].pixmap == XCB_NONE; j++) {
+            if (bgs[j].width == bgs[i].width && bgs[j].height == bgs[i].height)
+                bgs[i].pixmap = bgs[j].pixmap;
+        }
+        /* Take over the image from the previous screen layout, if possible. */
+        for (int j = 0; j < num_screen_bgs && bgs[i].pixmap == XCB_NONE; j++) {
+            if (screen_bgs[j].pixmap != XCB_NONE &&
+                screen_bgs[j].width == bgs[i].width &&
+                screen_bgs[j].height == bgs[i].height) {
+                bgs[i].pixmap = screen_bgs[j].pixmap;
+                bgs[i].owned = screen_bgs[j].owned;
+                screen_bgs[j].pixmap = XCB_NONE;
+            }
+        }
+        if (bgs[i].pixmap == XCB_NONE) {
+            bgs[i].pixmap = render_screen_background(bgs[i].width, bgs[i].height);
+            bgs[i].owned = true;
+        }
+
+        xcb_copy_area(conn, bgs[i].pixmap, render_ctx.bg.pixmap, gc,
+                      0, 0, screens[i].x, screens[i].y,
+                      screens[i].width, screens[i].height);
+    }
+
+    xcb_free_gc(conn, gc);
+
+    /* Free the images of screens which are gone. */
+    for (int j = 0; j < num_screen_bgs; j++) {
+        if (screen_bgs[j].pixmap != XCB_NONE && screen_bgs[j].owned)
+            xcb_free_pixmap(conn, screen_bgs[j].pixmap);
+    }
+    free(screen_bgs);
+    screen_bgs = bgs;
+    num_screen_bgs = n;
+}
+
+/*
+ * Uploads img into a pixmap of the same size, on top of the background color.
+ *
+ */
+static xcb_pixmap_t create_tile_pixmap(void) {
+    uint32_t tile_size[2] = {cairo_image_surface_get_width(img),
+                             cairo_image_surface_get_height(img)};
+    DEBUG("uploading %dx%d tile\n", tile_size[0], tile_size[1]);
+    xcb_pixmap_t pixmap = create_bg_pixmap(conn, screen, tile_size, color);
+
+    if (img_shm != NULL && shm_image_format_supported(conn, screen->root_depth)) {
+        shm_image_put(conn, pixmap, screen->root_depth, img_shm, 0, 0,
+                      tile_size[0], tile_size[1], 0, 0);
+        return pixmap;
+    }
+
+    cairo_surface_t *output = cairo_xcb_surface_create(conn, pixmap, vistype, tile_size[0], tile_size[1]);
+    cairo_t *ctx = cairo_create(output);
+    cairo_set_source_surface(ctx, img, 0, 0);
+    cairo_paint(ctx);
     cairo_destroy(ctx);
-    cairo_destroy(xcb_ctx);
-    return bg_pixmap;
+    cairo_surface_destroy(output);
+    return pixmap;
+}
+
+/*
+ * Paints the background color or image (-i) onto the given context, whose
+ * target is the background render target.
+ *
+ */
+static void draw_background(cairo_t *xcb_ctx, uint32_t *resolution) {
+    if (img) {
+        if (image_mode != IMAGE_MODE_NONE) {
+            cairo_surface_t *target = cairo_get_target(xcb_ctx);
+            cairo_surface_flush(target);
+            draw_screen_backgrounds(resolution);
+            cairo_surface_mark_dirty(target);
+        } else if (!tile && img_shm != NULL && shm_image_format_supported(conn, screen->root_depth)) {
+            /* Copy the image straight from shared memory into the pixmap. */
+            cairo_surface_t *target = cairo_get_target(xcb_ctx);
+            cairo_surface_flush(target);
+            shm_image_put(conn, render_ctx.bg.pixmap, screen->root_depth, img_shm, 0, 0,
+                          (img_shm->width < resolution[0] ? img_shm->width : resolution[0]),
+                          (img_shm->height < resolution[1] ? img_shm->height : resolution[1]),
+                          0, 0);
+            cairo_surface_mark_dirty(target);
+        } else if (!tile) {
+            cairo_set_source_surface(xcb_ctx, img, 0, 0);
+            cairo_paint(xcb_ctx);
+        } else {
+            /* Upload the tile only once and let the X server fill a rectangle
+             * as big as the screen with it. */
+            if (tile_pixmap == XCB_NONE)
+                tile_pixmap = create_tile_pixmap();
+            cairo_surface_t *target = cairo_get_target(xcb_ctx);
+            cairo_surface_flush(target);
+            fill_tiled(conn, render_ctx.bg.pixmap, tile_pixmap, resolution);
+            cairo_surface_mark_dirty(target);
+        }
+    } else {
+        set_source_color(xcb_ctx);
+        cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
+        cairo_fill(xcb_ctx);
+    }
+}
+
+/*
+ * Composites the unlock indicator onto the given rectangles of xcb_ctx, after
+ * restoring the clean background underneath.
+ *
+ */
+static void composite_indicator(cairo_t *xcb_ctx, xcb_rectangle_t *rects, int n, const indicator_state_t *state) {
+    const double scaling_factor = get_dpi_value() / 96.0;
+    int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
+
+    cairo_surface_t *sprite = NULL;
+    if (indicator_visible(state))
+        sprite = get_indicator_sprite(cairo_get_target(xcb_ctx), scaling_factor, button_diameter_physical, state);
+
+    for (int i = 0; i < n; i++) {
+        cairo_rectangle(xcb_ctx, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+
+        cairo_set_operator(xcb_ctx, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface(xcb_ctx, render_ctx.bg.surface, 0, 0);
+        if (sprite == NULL) {
+            cairo_fill(xcb_ctx);
+            continue;
+        }
+        cairo_fill_preserve(xcb_ctx);
+
+        cairo_set_operator(xcb_ctx, CAIRO_OPERATOR_OVER);
+        cairo_set_source_surface(xcb_ctx, sprite, rects[i].x, rects[i].y);
+        cairo_fill(xcb_ctx);
+
+        cairo_save(xcb_ctx);
+        cairo_translate(xcb_ctx, rects[i].x, rects[i].y);
+        draw_indicator_highlight(xcb_ctx, scaling_factor, state);
+        cairo_restore(xcb_ctx);
+    }
+}
+
+/*
+ * Returns true if the background was rendered for the current resolution and
+ * screen layout, i.e. only the unlock indicator needs to be redrawn.
+ *
+ */
+static bool background_is_current(void) {
+    if (!render_ctx.bg_valid ||
+        render_ctx.resolution[0] != last_resolution[0] ||
+        render_ctx.resolution[1] != last_resolution[1] ||
+        render_ctx.screens != xr_screens)
+        return false;
+
+    return (xr_screens == 0 ||
+            memcmp(render_ctx.layout, xr_resolutions, xr_screens * sizeof(Rect)) == 0);
+}
+
+static void alloc_render_target(render_target_t *target, uint32_t *resolution) {
+    target->pixmap = create_bg_pixmap(conn, screen, resolution, color);
+    target->surface = cairo_xcb_surface_create(conn, target->pixmap, vistype, resolution[0], resolution[1]);
+    target->ctx = cairo_create(target->surface);
+}
+
+static void free_render_target(render_target_t *target) {
+    if (target->pixmap == XCB_NONE)
+        return;
+    cairo_destroy(target->ctx);
+    cairo_surface_destroy(target->surface);
+    xcb_free_pixmap(conn, target->pixmap);
+    target->pixmap = XCB_NONE;
+}
+
+/*
+ * Makes sure that the render targets have the given resolution. They are only
+ * reallocated if it changed, and are only filled with the color then.
+ *
+ */
+static void alloc_render_targets(uint32_t *resolution) {
+    if (render_ctx.bg.pixmap != XCB_NONE &&
+        render_ctx.resolution[0] == resolution[0] &&
+        render_ctx.resolution[1] == resolution[1])
+        return;
+
+    DEBUG("allocating render targets for %dx%d\n", resolution[0], resolution[1]);
+    free_render_target(&render_ctx.bg);
+    free_render_target(&render_ctx.buffers[0]);
+    free_render_target(&render_ctx.buffers[1]);
+
+    alloc_render_target(&render_ctx.bg, resolution);
+    alloc_render_target(&render_ctx.buffers[0], resolution);
+    alloc_render_target(&render_ctx.buffers[1], resolution);
+
+    render_ctx.resolution[0] = resolution[0];
+    render_ctx.resolution[1] = resolution[1];
+    render_ctx.front = 0;
+    render_ctx.bg_valid = false;
 }
 
 /*
- * Calls draw_image on a new pixmap and swaps that with the current pixmap
+ * Renders the background for the given resolution and the current screen
+ * layout, and copies it into both window buffers.
+ *
+ */
+static void render_background(uint32_t *resolution) {
+    alloc_render_targets(resolution);
+
+    cairo_t *bg_ctx = render_ctx.bg.ctx;
+    cairo_save(bg_ctx);
+    if (img) {
+        /* Where the image does not cover the screen, the background color
+         * shows. The pixmap might still contain a previous layout. */
+        cairo_set_operator(bg_ctx, CAIRO_OPERATOR_SOURCE);
+        set_source_color(bg_ctx);
+        cairo_paint(bg_ctx);
+        cairo_set_operator(bg_ctx, CAIRO_OPERATOR_OVER);
+    }
+    draw_background(bg_ctx, resolution);
+    cairo_restore(bg_ctx);
+    cairo_surface_flush(render_ctx.bg.surface);
+
+    for (int i = 0; i < 2; i++) {
+        cairo_set_operator(render_ctx.buffers[i].ctx, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface(render_ctx.buffers[i].ctx, render_ctx.bg.surface, 0, 0);
+        cairo_paint(render_ctx.buffers[i].ctx);
+    }
+
+    /* Remember what the background was rendered for, see
+     * background_is_current(). */
+    render_ctx.bg_valid = true;
+    free(render_ctx.layout);
+    render_ctx.layout = NULL;
+    render_ctx.screens = 0;
+    if (xr_screens > 0 && (render_ctx.layout = malloc(xr_screens * sizeof(Rect))) != NULL) {
+        memcpy(render_ctx.layout, xr_resolutions, xr_screens * sizeof(Rect));
+        render_ctx.screens = xr_screens;
+    }
+}
+
+/*
+ * Draws the unlock indicator in the given state into the back buffer and
+ * makes it the front buffer, whose pixmap is returned. Only the given
+ * rectangles (see indicator_rects()) are touched: everything else is the
+ * same in both buffers.
+ *
+ */
+static xcb_pixmap_t render_indicator(xcb_rectangle_t *rects, int n, const indicator_state_t *state) {
+    render_target_t *back = &render_ctx.buffers[!render_ctx.front];
+    composite_indicator(back->ctx, rects, n, state);
+    cairo_surface_flush(back->surface);
+    render_ctx.front = !render_ctx.front;
+    return back->pixmap;
+}
+
+/*
+ * Fills in the given state from the global unlock/auth state.
+ *
+ */
+static void capture_state(indicator_state_t *state) {
+    state->unlock_state = unlock_state;
+    state->auth_state = auth_state;
+    state->failed_attempts = failed_attempts;
+    memcpy(state->modifier_string, modifier_string, sizeof(state->modifier_string));
+    state->modifier_string[sizeof(state->modifier_string) - 1] = '\0';
+    state->highlight_start = -1;
+    if (unlock_state == STATE_KEY_ACTIVE || unlock_state == STATE_BACKSPACE_ACTIVE)
+        state->highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
+}
+
+static bool state_equal(const indicator_state_t *a, const indicator_state_t *b) {
+    return (a->unlock_state == b->unlock_state &&
+            a->auth_state == b->auth_state &&
+            a->failed_attempts == b->failed_attempts &&
+            a->highlight_start == b->highlight_start &&
+            strcmp(a->modifier_string, b->modifier_string) == 0);
+}
+
+/*
+ * Draws global image with fill color and the unlock indicator in the given
+ * state onto a pixmap with the given resolution and returns it. The clean
+ * background is kept in the render context, so that subsequent redraws only
+ * need to update the unlock indicator.
+ *
+ */
+static xcb_pixmap_t render_image(uint32_t *resolution, const indicator_state_t *state) {
+    const double scaling_factor = get_dpi_value() / 96.0;
+    int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
+    DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
+          scaling_factor, button_diameter_physical);
+
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    /* The screen layout (or DPI) changed, so the cached frames might no
+     * longer fit. */
+    clear_sprite_cache();
+
+    render_background(resolution);
+
+    xcb_rectangle_t rects[xr_screens > 0 ? xr_screens : 1];
+    int n = indicator_rects(rects, button_diameter_physical);
+    return render_indicator(rects, n, state);
+}
+
+/*
+ * Draws global image with fill color onto a pixmap with the given
+ * resolution and returns it, right away (the window does not exist yet).
+ *
+ * The returned pixmap is owned by the unlock indicator and must not be freed.
+ *
+ */
+xcb_pixmap_t draw_image(uint32_t *resolution) {
+    capture_state(&drawn_state);
+    drawn_valid = true;
+    redraw_pending = false;
+    key_frame_pending = false;
+    return render_image(resolution, &drawn_state);
+}
+
+/*
+ * Renders the last requested state. Unless the resolution or the screen layout
+ * changed (in which case the whole window pixmap is re-rendered), only the
+ * areas covered by the unlock indicator are updated and exposed, and nothing
+ * at all if the indicator would look the same.
+ *
+ */
+static void render_frame(void) {
+    if (!redraw_pending)
+        return;
+    redraw_pending = false;
+    ev_timer_stop(main_loop, &frame_timer);
+
+    const bool key_frame = key_frame_pending;
+    key_frame_pending = false;
+    if (key_frame)
+        start_counting_allocations();
+
+    DEBUG("rendering frame (unlock_state = %d, auth_state = %d)\n",
+          pending_state.unlock_state, pending_state.auth_state);
+    if (!background_is_current()) {
+        drawn_state = pending_state;
+        drawn_valid = true;
+        xcb_pixmap_t pixmap = render_image(last_resolution, &drawn_state);
+        xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){pixmap});
+        xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
+        xcb_flush(conn);
+    } else if (drawn_valid && state_equal(&pending_state, &drawn_state)) {
+        DEBUG("frame unchanged, skipping\n");
+    } else {
+        drawn_state = pending_state;
+        drawn_valid = true;
+
+        const double scaling_factor = get_dpi_value() / 96.0;
+        int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
+        xcb_rectangle_t rects[xr_screens > 0 ? xr_screens : 1];
+        int n = indicator_rects(rects, button_diameter_physical);
+
+        xcb_pixmap_t pixmap = render_indicator(rects, n, &drawn_state);
+
+        /* Make the new front buffer the window background (for future
+         * exposures), then update only the indicator areas: either on the
+         * next vblank or right away. */
+        xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){pixmap});
+        if (present_active()) {
+            presented_serial = present_frame(pixmap, rects, n);
+            num_presented_latencies = 0;
+            for (int i = 0; i < num_pending_latencies; i++)
+                presented_latencies[num_presented_latencies++] = pending_latencies[i].pressed;
+        } else {
+            for (int i = 0; i < n; i++)
+                xcb_clear_area(conn, 0, win, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+        }
+        xcb_flush(conn);
+    }
+    last_frame = ev_time();
+
+    for (int i = 0; i < num_pending_latencies; i++)
+        trace_latency(pending_latencies[i].name, pending_latencies[i].pressed);
+    num_pending_latencies = 0;
+
+    if (key_frame)
+        check_key_allocations("key press frame", stop_counting_allocations());
+}
+
+/*
+ * Called once the X server reports the frame with the given serial as
+ * presented (--present). ust is the CLOCK_MONOTONIC time in microseconds at
+ * which it became visible, msc the number of the vblank.
+ *
+ */
+void frame_presented(uint32_t serial, uint64_t ust, uint64_t msc) {
+    if (serial == presented_serial) {
+        for (int i = 0; i < num_presented_latencies; i++)
+            trace_latency_until("key_to_photon", presented_latencies[i], ust * 1000);
+        num_presented_latencies = 0;
+    }
+
+    /* The next frame does not need to wait any longer. */
+    ev_timer_stop(main_loop, &frame_timer);
+}
+
+static void frame_timer_cb(EV_P_ ev_timer *w, int revents) {
+    render_frame();
+}
+
+static void redraw_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    if (!redraw_pending || ev_is_active(&frame_timer))
+        return;
+
+    /* Wait for the next frame if we just rendered one. With Present, the
+     * previous frame being presented paces the frames instead. */
+    ev_tstamp wait = (present_active() ? present_pending() : last_frame + FRAME_INTERVAL - ev_time());
+    if (wait > 0) {
+        ev_timer_set(&frame_timer, wait, 0.);
+        ev_timer_start(main_loop, &frame_timer);
+        return;
+    }
+    render_frame();
+}
+
+/*
+ * Sets up rendering the frames requested by redraw_screen() on main_loop.
+ *
+ */
+void init_redraw_scheduler(void) {
+    ev_prepare_init(&redraw_prepare, redraw_prepare_cb);
+    ev_prepare_start(main_loop, &redraw_prepare);
+    ev_timer_init(&frame_timer, frame_timer_cb, 0., 0.);
+}
+
+/*
+ * Requests a redraw of the unlock indicator in its current state, which is
+ * rendered with the next frame.
  *
  */
 void redraw_screen(void) {
-    DEBUG("redraw_screen(unlock_state = %d, auth_state = %d)\n", unlock_state, auth_state);
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
-    /* XXX: Possible optimization: Only update the area in the middle of the
-     * screen instead of the whole screen. */
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-    xcb_free_pixmap(conn, bg_pixmap);
-    xcb_flush(conn);
+    capture_state(&pending_state);
+    redraw_pending = true;
+    if (counting_allocations())
+        key_frame_pending = true;
+}
+
+/*
+ * Renders the requested redraw (if any) right away, e.g. when the frame needs
+ * to be on the screen before going on.
+ *
+ */
+void redraw_screen_now(void) {
+    render_frame();
+}
+
+/*
+ * For --trace-startup: records the time from the given key press until the
+ * frame showing its effect was sent to the X server.
+ *
+ */
+void redraw_screen_latency(const char *name, uint64_t pressed) {
+    if (pressed == 0)
+        return;
+    if (num_pending_latencies == MAX_PENDING_LATENCIES) {
+        trace_latency(name, pressed);
+        return;
+    }
+    pending_latencies[num_pending_latencies].name = name;
+    pending_latencies[num_pending_latencies].pressed = pressed;
+    num_pending_latencies++;
 }
 
 /*
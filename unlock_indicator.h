@@ -19,8 +19,23 @@ typedef enum {
     STATE_I3LOCK_LOCK_FAILED = 4, /* i3lock failed to load */
 } auth_state_t;
 
+typedef enum {
+    IMAGE_MODE_NONE = 0,    /* paint the image once, at the top left of the root window */
+    IMAGE_MODE_CENTER = 1,  /* center the (unscaled) image on each screen */
+    IMAGE_MODE_FILL = 2,    /* scale the image to cover each screen, cropping it */
+    IMAGE_MODE_FIT = 3,     /* scale the image to fit into each screen */
+    IMAGE_MODE_STRETCH = 4, /* scale the image to each screen, ignoring its aspect ratio */
+} image_mode_t;
+
+/* Size of the buffer for the list of pressed modifiers (modifier_string). */
+#define MODIFIER_STRING_SIZE 128
+
 xcb_pixmap_t draw_image(uint32_t* resolution);
+void init_redraw_scheduler(void);
 void redraw_screen(void);
+void redraw_screen_now(void);
+void redraw_screen_latency(const char *name, uint64_t pressed);
+void frame_presented(uint32_t serial, uint64_t ust, uint64_t msc);
 void clear_indicator(void);
 
 #endif
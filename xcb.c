@@ -11,6 +11,7 @@
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_aux.h>
+#include <xcb/shm.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -19,12 +20,19 @@
 #include <assert.h>
 #include <err.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
+#include "i3lock.h"
+#include "xcb.h"
 #include "cursors.h"
 #include "unlock_indicator.h"
+#include "trace.h"
 
 extern auth_state_t auth_state;
+extern bool debug_mode;
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
@@ -103,6 +111,216 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32
     return bg_pixmap;
 }
 
+/*
+ * Returns true if images with 32 bits per pixel in the host’s byte order (as
+ * used by cairo’s RGB24 format) can be uploaded to drawables of the given
+ * depth as-is, i.e. without any conversion.
+ *
+ */
+bool shm_image_format_supported(xcb_connection_t *conn, uint8_t depth) {
+    const xcb_setup_t *setup = xcb_get_setup(conn);
+    const uint32_t one = 1;
+    const uint8_t host_order = (*(const uint8_t *)&one == 1 ? XCB_IMAGE_ORDER_LSB_FIRST : XCB_IMAGE_ORDER_MSB_FIRST);
+
+    if (depth != 24 || setup->image_byte_order != host_order)
+        return false;
+
+    xcb_format_iterator_t iter;
+    for (iter = xcb_setup_pixmap_formats_iterator(setup); iter.rem; xcb_format_next(&iter)) {
+        if (iter.data->depth == depth)
+            return (iter.data->bits_per_pixel == 32);
+    }
+
+    return false;
+}
+
+/*
+ * Allocates an image with 32 bits per pixel, preferably in a POSIX shared
+ * memory object which can later be attached to the X server (MIT-SHM). Falls
+ * back to regular memory if that is not possible.
+ *
+ * Returns NULL if no memory could be allocated at all.
+ *
+ */
+shm_image_t *shm_image_create(uint16_t width, uint16_t height) {
+    static int counter = 0;
+    shm_image_t *image = calloc(sizeof(shm_image_t), 1);
+    if (image == NULL)
+        return NULL;
+
+    image->width = width;
+    image->height = height;
+    image->stride = width * 4;
+    image->size = (size_t)image->stride * height;
+    image->fd = -1;
+    image->shmseg = XCB_NONE;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/i3lock-%d-%d", (int)getpid(), counter++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd != -1) {
+        /* The object only needs to live as long as the file descriptor. */
+        shm_unlink(name);
+        if (ftruncate(fd, image->size) == 0 &&
+            (image->data = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+            image->fd = fd;
+            image->shared = true;
+            return image;
+        }
+        close(fd);
+    }
+
+    DEBUG("Could not allocate shared memory for a %dx%d image, using regular memory\n",
+          width, height);
+    image->shared = false;
+    if ((image->data = calloc(image->size, 1)) == NULL) {
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+/*
+ * Attaches the shared memory of the image to the X server, if MIT-SHM ≥ 1.2
+ * (file descriptor passing) is supported. Returns true on success.
+ *
+ */
+static bool shm_image_attach(xcb_connection_t *conn, shm_image_t *image) {
+    /* -1 = unknown, 0 = unsupported, 1 = supported */
+    static int shm_supported = -1;
+
+    if (image->shmseg != XCB_NONE)
+        return true;
+    if (image->fd == -1)
+        return false;
+
+    if (shm_supported == -1) {
+        shm_supported = 0;
+        const xcb_query_extension_reply_t *extreply = xcb_get_extension_data(conn, &xcb_shm_id);
+        if (extreply != NULL && extreply->present) {
+            trace_round_trip("ShmQueryVersion");
+            xcb_shm_query_version_reply_t *version =
+                xcb_shm_query_version_reply(conn, xcb_shm_query_version(conn), NULL);
+            if (version != NULL &&
+                (version->major_version > 1 ||
+                 (version->major_version == 1 && version->minor_version >= 2)))
+                shm_supported = 1;
+            free(version);
+        }
+        DEBUG("MIT-SHM %s\n", shm_supported ? "supported" : "not supported, using PutImage");
+    }
+
+    if (shm_supported) {
+        /* XCB takes ownership of the file descriptor and closes it. */
+        xcb_shm_seg_t shmseg = xcb_generate_id(conn);
+        trace_round_trip("ShmAttachFd");
+        xcb_generic_error_t *error = xcb_request_check(conn, xcb_shm_attach_fd_checked(conn, shmseg, image->fd, true));
+        image->fd = -1;
+        if (error == NULL) {
+            image->shmseg = shmseg;
+            return true;
+        }
+        DEBUG("Could not attach shared memory: X11 error code %d\n", error->error_code);
+        free(error);
+        return false;
+    }
+
+    close(image->fd);
+    image->fd = -1;
+    return false;
+}
+
+/*
+ * Copies the given part of the image onto the drawable. The image data is
+ * shared with the X server (MIT-SHM) if possible, otherwise it is sent over
+ * the socket using as few PutImage requests as possible.
+ *
+ */
+void shm_image_put(xcb_connection_t *conn, xcb_drawable_t drawable, uint8_t depth, shm_image_t *image,
+                   uint16_t src_x, uint16_t src_y, uint16_t width, uint16_t height, int16_t dst_x, int16_t dst_y) {
+    xcb_gcontext_t gc = xcb_generate_id(conn);
+    xcb_create_gc(conn, gc, drawable, 0, NULL);
+
+    if (shm_image_attach(conn, image)) {
+        xcb_shm_put_image(conn, drawable, gc,
+                          image->width, image->height,
+                          src_x, src_y, width, height,
+                          dst_x, dst_y,
+                          depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                          false /* send_event */,
+                          image->shmseg, 0 /* offset */);
+        xcb_free_gc(conn, gc);
+        return;
+    }
+
+    /* Send as many rows per request as the maximum request length permits.
+     * Rows need to be copied unless the whole width is sent. */
+    const size_t row_len = (size_t)width * 4;
+    const size_t max_len = (size_t)xcb_get_maximum_request_length(conn) * 4 - sizeof(xcb_put_image_request_t);
+    uint32_t rows = (row_len > 0 ? max_len / row_len : 0);
+    if (rows == 0)
+        rows = 1;
+    if (rows > height)
+        rows = height;
+
+    const bool contiguous = (row_len == image->stride);
+    uint8_t *buf = NULL;
+    if (!contiguous && (buf = malloc(row_len * rows)) == NULL) {
+        xcb_free_gc(conn, gc);
+        return;
+    }
+
+    for (uint32_t y = 0; y < height; y += rows) {
+        const uint32_t n = (height - y < rows ? height - y : rows);
+        const uint8_t *src = image->data + (size_t)(src_y + y) * image->stride + (size_t)src_x * 4;
+        if (!contiguous) {
+            for (uint32_t row = 0; row < n; row++)
+                memcpy(buf + row * row_len, src + (size_t)row * image->stride, row_len);
+            src = buf;
+        }
+        xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, drawable, gc,
+                      width, n, dst_x, dst_y + y, 0, depth, row_len * n, src);
+    }
+
+    free(buf);
+    xcb_free_gc(conn, gc);
+}
+
+/*
+ * Detaches (if necessary) and frees the image. conn may be NULL if the image
+ * was never put, e.g. when freeing it on a worker thread.
+ *
+ */
+void shm_image_free(xcb_connection_t *conn, shm_image_t *image) {
+    if (image == NULL)
+        return;
+
+    if (image->shmseg != XCB_NONE)
+        xcb_shm_detach(conn, image->shmseg);
+    if (image->fd != -1)
+        close(image->fd);
+
+    if (image->shared)
+        munmap(image->data, image->size);
+    else
+        free(image->data);
+    free(image);
+}
+
+/*
+ * Fills the given area of the drawable with the tile pixmap, repeated by the X
+ * server (i.e. without transferring any image data).
+ *
+ */
+void fill_tiled(xcb_connection_t *conn, xcb_drawable_t drawable, xcb_pixmap_t tile, uint32_t *resolution) {
+    xcb_gcontext_t gc = xcb_generate_id(conn);
+    uint32_t values[] = {XCB_FILL_STYLE_TILED, tile};
+    xcb_create_gc(conn, gc, drawable, XCB_GC_FILL_STYLE | XCB_GC_TILE, values);
+    xcb_rectangle_t rect = {0, 0, resolution[0], resolution[1]};
+    xcb_poly_fill_rectangle(conn, drawable, gc, 1, &rect);
+    xcb_free_gc(conn, gc);
+}
+
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
     uint32_t mask = 0;
     uint32_t values[3];
@@ -158,121 +376,25 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
                         2 * (strlen("i3lock") + 1),
                         "i3lock\0i3lock\0");
 
-    /* Map the window (= make it visible) */
-    xcb_map_window(conn, win);
-
-    /* Raise window (put it on top) */
-    values[0] = XCB_STACK_MODE_ABOVE;
-    xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
-
-    /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
-
+    /* No need to wait for the X server here: requests are processed in order,
+     * so the window exists for everything we send after this. */
     return win;
 }
 
 /*
- * Repeatedly tries to grab pointer and keyboard (up to the specified number of
- * tries).
- *
- * Returns true if the grab succeeded, false if not.
+ * Maps the window created by open_fullscreen_window() and raises it on top of
+ * all other windows.
  *
  */
-bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries) {
-    xcb_grab_pointer_cookie_t pcookie;
-    xcb_grab_pointer_reply_t *preply;
-
-    xcb_grab_keyboard_cookie_t kcookie;
-    xcb_grab_keyboard_reply_t *kreply;
-
-    const suseconds_t screen_redraw_timeout = 100000; /* 100ms */
-
-    /* Using few variables to trigger a redraw_screen() if too many tries */
-    bool redrawn = false;
-    struct timeval start;
-    if (gettimeofday(&start, NULL) == -1) {
-        err(EXIT_FAILURE, "gettimeofday");
-    }
-
-    while (tries-- > 0) {
-        pcookie = xcb_grab_pointer(
-            conn,
-            false,               /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
-            XCB_NONE,            /* which events to let through */
-            XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
-            XCB_GRAB_MODE_ASYNC, /* keyboard mode */
-            XCB_NONE,            /* confine_to = in which window should the cursor stay */
-            cursor,              /* we change the cursor to whatever the user wanted */
-            XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(preply);
-            break;
-        }
-
-        /* In case the grab failed, we still need to free the reply */
-        free(preply);
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
-        }
-
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
-
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
-            redraw_screen();
-            redrawn = true;
-        }
-    }
-
-    while (tries-- > 0) {
-        kcookie = xcb_grab_keyboard(
-            conn,
-            true,         /* report events */
-            screen->root, /* grab the root window */
-            XCB_CURRENT_TIME,
-            XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
-            XCB_GRAB_MODE_ASYNC);
-
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(kreply);
-            break;
-        }
-
-        /* In case the grab failed, we still need to free the reply */
-        free(kreply);
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
-        }
-
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
+void map_fullscreen_window(xcb_connection_t *conn, xcb_window_t win) {
+    /* Map the window (= make it visible) */
+    xcb_map_window(conn, win);
 
-        /* Trigger a screen redraw if 100ms elapsed */
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
-            redraw_screen();
-            redrawn = true;
-        }
-    }
+    /* Raise window (put it on top) */
+    uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+    xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
-    return (tries > 0);
+    xcb_flush(conn);
 }
 
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice) {
@@ -339,16 +461,33 @@ xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_win
 }
 
 static xcb_atom_t _NET_ACTIVE_WINDOW = XCB_NONE;
+static xcb_intern_atom_cookie_t net_active_window_cookie;
+static bool net_active_window_requested = false;
+
+/*
+ * Sends the requests for the atoms we need later on, so that the replies
+ * arrive along with the ones we are waiting for in the meantime instead of
+ * costing a round trip of their own.
+ *
+ */
+void prefetch_atoms(xcb_connection_t *conn) {
+    if (net_active_window_requested)
+        return;
+    net_active_window_cookie = xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW");
+    net_active_window_requested = true;
+}
+
 void _init_net_active_window(xcb_connection_t *conn) {
     if (_NET_ACTIVE_WINDOW != XCB_NONE) {
         /* already initialized */
         return;
     }
+    prefetch_atoms(conn);
+    net_active_window_requested = false;
+
     xcb_generic_error_t *err;
-    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(
-        conn,
-        xcb_intern_atom(conn, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW"),
-        &err);
+    trace_round_trip("InternAtom");
+    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(conn, net_active_window_cookie, &err);
     if (atom_reply == NULL) {
         fprintf(stderr, "X11 Error %d\n", err->error_code);
         free(err);
@@ -358,11 +497,87 @@ void _init_net_active_window(xcb_connection_t *conn) {
     free(atom_reply);
 }
 
+/*
+ * Makes us the locker of this display by acquiring the _I3LOCK_S<screen>
+ * selection, which is done atomically (with the server grabbed). The
+ * selection is owned by a 1x1 InputOnly window and released by the X server
+ * when our connection is closed. The WM_NAME of that window tells other
+ * instances whether it belongs to a daemon.
+ *
+ * Returns LOCK_ACQUIRED, or who else owns the selection already.
+ *
+ */
+lock_owner_t acquire_lock_selection(xcb_connection_t *conn, xcb_window_t root, int screen_number, bool daemon) {
+    const char *owner_name = (daemon ? LOCK_OWNER_NAME_DAEMON : LOCK_OWNER_NAME);
+    char name[32];
+    snprintf(name, sizeof(name), "_I3LOCK_S%d", screen_number);
+
+    xcb_intern_atom_cookie_t atom_cookie = xcb_intern_atom(conn, 0, strlen(name), name);
+
+    xcb_window_t owner = xcb_generate_id(conn);
+    xcb_create_window(conn, XCB_COPY_FROM_PARENT, owner, root,
+                      -1, -1, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT,
+                      0, NULL);
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, owner, XCB_ATOM_WM_NAME,
+                        XCB_ATOM_STRING, 8, strlen(owner_name), owner_name);
+
+    trace_round_trip("InternAtom");
+    xcb_intern_atom_reply_t *atom_reply = xcb_intern_atom_reply(conn, atom_cookie, NULL);
+    if (atom_reply == NULL) {
+        /* Better lock twice than not at all. */
+        fprintf(stderr, "[i3lock] Could not intern %s, not checking for other instances\n", name);
+        xcb_destroy_window(conn, owner);
+        xcb_flush(conn);
+        return LOCK_ACQUIRED;
+    }
+    xcb_atom_t atom = atom_reply->atom;
+    free(atom_reply);
+
+    xcb_grab_server(conn);
+    trace_round_trip("GetSelectionOwner");
+    xcb_get_selection_owner_reply_t *owner_reply =
+        xcb_get_selection_owner_reply(conn, xcb_get_selection_owner(conn, atom), NULL);
+    xcb_window_t other = (owner_reply != NULL ? owner_reply->owner : XCB_NONE);
+    free(owner_reply);
+
+    if (other != XCB_NONE)
+        xcb_destroy_window(conn, owner);
+    else
+        xcb_set_selection_owner(conn, owner, atom, XCB_CURRENT_TIME);
+    xcb_ungrab_server(conn);
+
+    if (other == XCB_NONE) {
+        xcb_flush(conn);
+        return LOCK_ACQUIRED;
+    }
+
+    /* Only the losing instance pays for this round trip. If the owner is gone
+     * by now, it is not known (and we better lock). */
+    trace_round_trip("GetProperty");
+    xcb_get_property_reply_t *prop_reply = xcb_get_property_reply(
+        conn,
+        xcb_get_property(conn, false, other, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 0, 32),
+        NULL);
+    lock_owner_t result = LOCK_OWNER_UNKNOWN;
+    if (prop_reply != NULL) {
+        int len = xcb_get_property_value_length(prop_reply);
+        const char *value = xcb_get_property_value(prop_reply);
+        if (len == (int)strlen(LOCK_OWNER_NAME) && strncmp(value, LOCK_OWNER_NAME, len) == 0)
+            result = LOCK_OWNER_LOCKER;
+        else if (len == (int)strlen(LOCK_OWNER_NAME_DAEMON) && strncmp(value, LOCK_OWNER_NAME_DAEMON, len) == 0)
+            result = LOCK_OWNER_DAEMON;
+        free(prop_reply);
+    }
+    return result;
+}
+
 xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root) {
     xcb_window_t result = XCB_NONE;
 
     _init_net_active_window(conn);
 
+    trace_round_trip("GetProperty");
     xcb_get_property_reply_t *prop_reply = xcb_get_property_reply(
         conn,
         xcb_get_property_unchecked(
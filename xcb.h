@@ -1,16 +1,55 @@
 #ifndef _XCB_H
 #define _XCB_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+/* An image with 32 bits per pixel whose data can be shared with the X server
+ * via MIT-SHM, see shm_image_create(). */
+typedef struct shm_image {
+    uint8_t *data;
+    uint16_t width;
+    uint16_t height;
+    uint32_t stride;
+    size_t size;
+
+    /* Whether data lives in a shared memory object (as opposed to malloc). */
+    bool shared;
+    /* The shared memory object, until it is attached to the X server. */
+    int fd;
+    xcb_shm_seg_t shmseg;
+} shm_image_t;
+
+/* Who owns the lock selection of a screen, see acquire_lock_selection(). */
+typedef enum {
+    LOCK_ACQUIRED = 0,      /* nobody else, we own it now */
+    LOCK_OWNER_LOCKER = 1,  /* another i3lock, which is locking the screen */
+    LOCK_OWNER_DAEMON = 2,  /* an i3lock --daemon, which might not be locked */
+    LOCK_OWNER_UNKNOWN = 3, /* a client which does not identify as i3lock */
+} lock_owner_t;
+
+/* The WM_NAME of the window owning the lock selection. */
+#define LOCK_OWNER_NAME "i3lock"
+#define LOCK_OWNER_NAME_DAEMON "i3lock --daemon"
 
 extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
 
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
+void fill_tiled(xcb_connection_t *conn, xcb_drawable_t drawable, xcb_pixmap_t tile, uint32_t *resolution);
+bool shm_image_format_supported(xcb_connection_t *conn, uint8_t depth);
+shm_image_t *shm_image_create(uint16_t width, uint16_t height);
+void shm_image_put(xcb_connection_t *conn, xcb_drawable_t drawable, uint8_t depth, shm_image_t *image,
+                   uint16_t src_x, uint16_t src_y, uint16_t width, uint16_t height, int16_t dst_x, int16_t dst_y);
+void shm_image_free(xcb_connection_t *conn, shm_image_t *image);
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
-bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries);
+void map_fullscreen_window(xcb_connection_t *conn, xcb_window_t win);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
+void prefetch_atoms(xcb_connection_t *conn);
+lock_owner_t acquire_lock_selection(xcb_connection_t *conn, xcb_window_t root, int screen_number, bool daemon);
 xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root);
 void set_focused_window(xcb_connection_t *conn, const xcb_window_t root, const xcb_window_t window);
 